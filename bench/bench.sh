@@ -0,0 +1,100 @@
+#!/bin/bash
+
+# Runs typical workloads with one or more sfo binaries on a corpus (see
+# mkcorpus.sh) and prints each workload's best time per binary, so builds can
+# be compared. A binary can be followed by options, separated by spaces (e.g.
+# "build/sfo --metrics-file m.prom"), to measure their overhead. With RUNS=1 and
+# output discarded, it doubles as the training run for profile-guided
+# optimization.
+
+show_usage() {
+  echo "Usage: ${0##*/} CORPUS_DIRECTORY SFO_BINARY..." >&2
+  echo "Environment: RUNS (default: 5), WORKLOADS (default: all)" >&2
+}
+
+if [[ $# -lt 2 ]]; then
+  show_usage
+  exit 1
+fi
+
+corpus=$1
+shift
+binaries=("$@")
+runs=${RUNS:-5}
+files=("$corpus"/*.sfo "$corpus"/*.pkg)
+sfo_files=("$corpus"/*.sfo)
+pkg_files=("$corpus"/*.pkg)
+work_dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$work_dir"' EXIT
+
+# Workloads, run with $sfo set to the binary and its options
+workloads=(${WORKLOADS:-print query check verify stats-report duplicates diff
+  modify validate})
+print() {
+  for file in "${files[@]:0:200}"; do $sfo "$file"; done
+}
+query() {
+  for file in "${files[@]:0:200}"; do $sfo -q TITLE "$file"; done
+}
+check() {
+  $sfo --check "${files[@]}"
+}
+verify() {
+  $sfo --verify "${pkg_files[@]}"
+}
+stats-report() {
+  $sfo --stats-report json "${files[@]}"
+}
+duplicates() {
+  $sfo --duplicates "${files[@]}"
+}
+diff() {
+  $sfo --diff "${files[@]}"
+}
+modify() {
+  cp "${sfo_files[@]}" "$work_dir"
+  $sfo -s str PUBTOOLINFO "c_date=20220101" --reserve 10 "$work_dir"/*.sfo
+}
+validate() { # Mostly string validation: 2000 long, partly non-ASCII strings
+  local i
+  for ((i = 0; i < 20; i++)); do $sfo --check "$work_dir/validate.sfo"; done
+}
+
+# Create the file for workload "validate" (about 8 MiB of strings)
+value=$(printf 'Grand Adventure %.0s' {1..200})
+value+=$(printf 'Größe 日本語 %.0s' {1..50})
+for ((i = 0; i < 2000; i++)); do
+  printf "%s\tstr\tKEY_%04d\t%s\n" "$work_dir/validate.sfo" $i "$value"
+done | ${binaries[0]%% *} --build-from - > /dev/null || exit 1
+
+# Prints the current time in nanoseconds
+now() {
+  date +%s%N
+}
+
+printf "%-14s" workload
+widths=()
+for binary in "${binaries[@]}"; do
+  name=${binary%% *}
+  label=${name##*/}${binary#"$name"} # Shows the binary's options
+  widths+=($((${#label} > 12 ? ${#label} + 2 : 14)))
+  printf "%${widths[-1]}s" "$label"
+done
+printf "\n"
+
+for workload in "${workloads[@]}"; do
+  printf "%-14s" "$workload"
+  for i in "${!binaries[@]}"; do
+    sfo=${binaries[i]}
+    best=
+    for ((run = 0; run < runs; run++)); do
+      start=$(now)
+      $workload > /dev/null 2>&1
+      time=$(($(now) - start))
+      [[ -z $best || $time -lt $best ]] && best=$time
+    done
+    printf "%$((widths[i] - 3))d ms" $((best / 1000000))
+  done
+  printf "\n"
+done
+printf "(best of %d runs, %d files)\n" "$runs" "${#files[@]}"
@@ -0,0 +1,123 @@
+#!/bin/bash
+
+# Creates a synthetic library of PS4 param.sfo and PKG files, for training
+# profile-guided optimization and for benchmarks.
+# The files mimic real ones: the usual parameters, a few titles with several
+# versions, some identical copies, and PKG files with an SHA-256 digest table.
+
+show_usage() {
+  echo "Usage: ${0##*/} SFO_BINARY DIRECTORY [COUNT] [SEED]" >&2
+}
+
+if [[ $# -lt 2 ]]; then
+  show_usage
+  exit 1
+fi
+
+sfo=$1
+dir=$2
+count=${3:-1000}
+RANDOM=${4:-1}
+
+mkdir -p "$dir" || exit 1
+
+# Prints a 32-bit number as 4 big-endian bytes
+be32() {
+  printf "\\x$(printf %02x $(($1 >> 24 & 255)))\\x$(printf %02x $(($1 >> 16 & 255)))\\x$(printf %02x $(($1 >> 8 & 255)))\\x$(printf %02x $(($1 & 255)))"
+}
+
+# Prints N zero bytes
+zeros() {
+  head -c "$1" /dev/zero
+}
+
+# Prints a file's SHA-256 digest as 32 bytes
+digest() {
+  printf "$(sha256sum "$1" | cut -c 1-64 | sed 's/../\\x&/g')"
+}
+
+# Wraps a param.sfo file and an icon into a PKG file, with a digest table
+# (entry 0x0001), the param.sfo (0x1000), and the icon (0x1200); the header's
+# body covers everything from the file table to the end of the file
+make_pkg() {
+  local sfo_file=$1 icon_file=$2 pkg_file=$3
+  local table_offset=8192
+  local digests_offset=$((table_offset + 3 * 32))
+  local sfo_offset=$((digests_offset + 3 * 32))
+  local sfo_size=$(stat -c %s "$sfo_file")
+  local icon_offset=$(((sfo_offset + sfo_size + 15) / 16 * 16))
+  local icon_size=$(stat -c %s "$icon_file")
+  local game_size=$((RANDOM * 4))
+  local body_size=$((icon_offset + icon_size + game_size - table_offset))
+  {
+    printf '\x7fCNT'
+    zeros 8
+    be32 3 # Entries
+    zeros 8
+    be32 $table_offset
+    zeros 8
+    be32 $table_offset # Body offset and size, 64-bit
+    zeros 4
+    be32 $body_size
+    zeros $((table_offset - 48))
+    for entry in "1 $digests_offset 96" "4096 $sfo_offset $sfo_size" \
+      "4608 $icon_offset $icon_size"; do
+      set -- $entry
+      be32 $1; zeros 12; be32 $2; be32 $3; zeros 8
+    done
+    zeros 32
+    digest "$sfo_file"
+    digest "$icon_file"
+    cat "$sfo_file"
+    zeros $((icon_offset - sfo_offset - sfo_size))
+    cat "$icon_file"
+    # Stand-in for the game data
+    zeros $game_size
+  } > "$pkg_file"
+}
+
+words=(Super Mario Bros Space Quest Legend Dark Souls Racing Street Fighter
+  Knight Dragon Tales Battle Force Zero Shadow Kingdom Ultimate Edition)
+categories=(gd gd gd gd gp gp ac)
+firmwares=(0x05050000 0x06720000 0x07550000 0x09000000 0x10010000)
+icon="$dir/.icon0.png"
+printf '\x89PNG\r\n\x1a\n' > "$icon"
+head -c 4096 /dev/urandom >> "$icon"
+
+for ((i = 0; i < count; i++)); do
+  # Every 4th file is another version of the previous title, every 10th file
+  # a copy of the previous file
+  if ((i % 10 == 9)); then
+    cp "$file" "$dir/$(printf %05d $i).${file##*.}"
+    continue
+  fi
+  ((i % 4 == 3)) || title_id=$(printf CUSA%05d $((RANDOM % 100000)))
+  version=$(printf 01.%02d $((i % 4 == 3 ? RANDOM % 20 + 1 : 0)))
+  category=${categories[RANDOM % ${#categories[@]}]}
+  [[ $version != 01.00 ]] && category=gp
+  title="${words[RANDOM % ${#words[@]}]} ${words[RANDOM % ${#words[@]}]}"
+  file="$dir/$(printf %05d $i).sfo"
+  "$sfo" --new-file -f \
+    -a int APP_TYPE 1 \
+    -a str APP_VER "$version" \
+    -a int ATTRIBUTE $((RANDOM % 64)) \
+    -a str CATEGORY "$category" \
+    -a str CONTENT_ID "EP0001-${title_id}_00-$(printf %016X $i)" \
+    -a int DOWNLOAD_DATA_SIZE 0 \
+    -a str FORMAT obs \
+    -a int PARENTAL_LEVEL $((RANDOM % 10)) \
+    -a str PUBTOOLINFO "c_date=2022$(printf %04d $((RANDOM % 1200 + 101))),img0_l0_size=$RANDOM" \
+    -a int PUBTOOLVER 0x02890000 \
+    -a int SYSTEM_VER "${firmwares[RANDOM % ${#firmwares[@]}]}" \
+    -a str TITLE "$title" \
+    -a str TITLE_00 "$title" \
+    -a str TITLE_ID "$title_id" \
+    -a str VERSION 01.00 \
+    "$file" || exit 1
+  if ((i % 2)); then
+    make_pkg "$file" "$icon" "${file%.sfo}.pkg" || exit 1
+    rm "$file"
+    file=${file%.sfo}.pkg
+  fi
+done
+rm "$icon"
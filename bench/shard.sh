@@ -0,0 +1,104 @@
+#!/bin/bash
+
+# Checks that splitting work with options --shard and --merge gives the same
+# results as a single run, for every mode, by running all N parts locally on a
+# corpus (see mkcorpus.sh). Fails if any mode's results differ.
+
+show_usage() {
+  echo "Usage: ${0##*/} SFO_BINARY CORPUS_DIRECTORY [N]" >&2
+}
+
+if [[ $# -lt 2 ]]; then
+  show_usage
+  exit 1
+fi
+
+sfo=$1
+corpus=$2
+n=${3:-3}
+files=("$corpus"/*.sfo "$corpus"/*.pkg)
+work_dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$work_dir"' EXIT
+exit_code=0
+
+# Prints whether two files are identical; returns 1 if they differ
+compare() {
+  local name=$1
+  if cmp -s "$2" "$3"; then
+    echo "ok      $name"
+  else
+    echo "FAILED  $name" >&2
+    diff "$2" "$3" | head -5 >&2
+    return 1
+  fi
+}
+
+# Per-file modes: the parts' output lines must be the single run's lines
+for mode in --check --verify; do
+  "$sfo" $mode "${files[@]}" | sort > "$work_dir/single"
+  for ((k = 1; k <= n; k++)); do
+    "$sfo" $mode --shard $k/$n "${files[@]}"
+  done | sort > "$work_dir/merged"
+  compare "$mode" "$work_dir/single" "$work_dir/merged" || exit_code=1
+done
+
+# Library modes: each part writes a cache segment, which are merged
+for ((k = 1; k <= n; k++)); do
+  "$sfo" --duplicates --shard $k/$n --cache "$work_dir/part$k.cache" \
+    "${files[@]}" > /dev/null
+  segments+=("$work_dir/part$k.cache")
+done
+for mode in --duplicates "--stats-report json" "--stats-report table" --diff; do
+  "$sfo" $mode "${files[@]}" > "$work_dir/single"
+  "$sfo" $mode --merge "${segments[@]}" > "$work_dir/merged"
+  compare "$mode" "$work_dir/single" "$work_dir/merged" || exit_code=1
+done
+
+# Option --diff can also split the diffs after merging
+"$sfo" --diff "${files[@]}" > "$work_dir/single"
+for ((k = 1; k <= n; k++)); do
+  "$sfo" --diff --merge --shard $k/$n "${segments[@]}"
+done > "$work_dir/merged"
+compare "--diff --merge --shard" "$work_dir/single" "$work_dir/merged" \
+  || exit_code=1
+
+# Merged segments must form the same cache file as a single run
+"$sfo" --duplicates --cache "$work_dir/single.cache" "${files[@]}" > /dev/null
+"$sfo" --merge --cache "$work_dir/merged.cache" "${segments[@]}"
+compare "--merge --cache" "$work_dir/single.cache" "$work_dir/merged.cache" \
+  || exit_code=1
+
+# Extraction and modification must produce the same files
+pkg_files=("$corpus"/*.pkg)
+entries=(--entry param.sfo --entry icon0.png)
+"$sfo" --extract "$work_dir/single-extract" "${entries[@]}" "${pkg_files[@]}"
+for ((k = 1; k <= n; k++)); do
+  "$sfo" --extract "$work_dir/merged-extract" "${entries[@]}" --shard $k/$n \
+    "${pkg_files[@]}"
+done
+if diff -r "$work_dir/single-extract" "$work_dir/merged-extract" > /dev/null
+then
+  echo "ok      --extract"
+else
+  echo "FAILED  --extract" >&2
+  exit_code=1
+fi
+
+mkdir "$work_dir/single-modify" "$work_dir/merged-modify"
+cp "$corpus"/*.sfo "$work_dir/single-modify"
+cp "$corpus"/*.sfo "$work_dir/merged-modify"
+"$sfo" -s str PUBTOOLINFO "c_date=20220101" "$work_dir/single-modify"/*.sfo \
+  > /dev/null
+for ((k = 1; k <= n; k++)); do
+  "$sfo" -s str PUBTOOLINFO "c_date=20220101" --shard $k/$n \
+    "$work_dir/merged-modify"/*.sfo > /dev/null
+done
+if diff -r "$work_dir/single-modify" "$work_dir/merged-modify" > /dev/null
+then
+  echo "ok      modification"
+else
+  echo "FAILED  modification" >&2
+  exit_code=1
+fi
+
+exit $exit_code
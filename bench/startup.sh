@@ -0,0 +1,98 @@
+#!/bin/bash
+
+# Measures the time of short sfo invocations (printing a file, querying a
+# parameter), from process start to exit, like hyperfine does. Each invocation
+# is also measured with option -j 1 added, which makes sfo take the regular path
+# instead of the single-file fast path; the two are run alternately, so that
+# changes in the machine's load affect both alike. Fails if a mean time exceeds
+# the budget, or if the fast path is slower than the regular path by more than
+# 3 standard errors, so startup regressions are noticed but noise is not.
+
+show_usage() {
+  echo "Usage: ${0##*/} SFO_BINARY SFO_FILE PKG_FILE" >&2
+  echo "Environment: RUNS (default: 1000), BUDGET_US (default: 2000)" >&2
+}
+
+if [[ $# -ne 3 ]]; then
+  show_usage
+  exit 1
+fi
+
+sfo=$1
+runs=${RUNS:-1000}
+budget=${BUDGET_US:-2000}
+exit_code=0
+
+# Stores a command's run time in microseconds in variable time
+run() {
+  local start=${EPOCHREALTIME/./}
+  "$@" > /dev/null
+  time=$((${EPOCHREALTIME/./} - start))
+}
+
+# Prints mean ± standard deviation, min, and max of run times in microseconds,
+# given their sum, sum of squares, min, and max; returns 1 if the mean exceeds
+# the budget
+print_times() {
+  local name=$1 sum=$2 sum_squares=$3 min=$4 max=$5
+  local mean=$((sum / runs))
+  local deviation=$(awk "BEGIN { printf \"%d\", \
+    sqrt($sum_squares / $runs - $mean * $mean) }")
+  printf "%-26s %6d µs ± %5d µs  [%d … %d µs]\n" "$name" "$mean" \
+    "$deviation" "$min" "$max"
+  if [[ $mean -gt $budget ]]; then
+    echo "$name: mean time exceeds budget of $budget µs" >&2
+    return 1
+  fi
+}
+
+# Measures an invocation on the fast path and on the regular path; returns 1 if
+# either exceeds the budget or if the fast path is significantly slower
+compare() {
+  local name=$1 status=0
+  shift
+  local fast_sum=0 fast_squares=0 fast_min= fast_max=0
+  local regular_sum=0 regular_squares=0 regular_min= regular_max=0
+  local saved_sum=0 saved_squares=0 fast_time saved
+  for ((i = 0; i < 10; i++)); do # Warm up the page cache
+    run "$sfo" "$@"
+    run "$sfo" -j 1 "$@"
+  done
+  for ((i = 0; i < runs; i++)); do
+    run "$sfo" "$@"
+    fast_time=$time
+    fast_sum=$((fast_sum + time))
+    fast_squares=$((fast_squares + time * time))
+    [[ -z $fast_min || $time -lt $fast_min ]] && fast_min=$time
+    [[ $time -gt $fast_max ]] && fast_max=$time
+    run "$sfo" -j 1 "$@"
+    regular_sum=$((regular_sum + time))
+    regular_squares=$((regular_squares + time * time))
+    [[ -z $regular_min || $time -lt $regular_min ]] && regular_min=$time
+    [[ $time -gt $regular_max ]] && regular_max=$time
+    saved=$((time - fast_time))
+    saved_sum=$((saved_sum + saved))
+    saved_squares=$((saved_squares + saved * saved))
+  done
+  print_times "$name" $fast_sum $fast_squares $fast_min $fast_max || status=1
+  print_times "$name (regular)" $regular_sum $regular_squares $regular_min \
+    $regular_max || status=1
+
+  # Mean and standard error of the time saved per run
+  read -r saved error < <(awk "BEGIN { mean = $saved_sum / $runs; printf \
+    \"%d %d\", mean, sqrt(($saved_squares / $runs - mean * mean) / $runs) }")
+  printf "%-26s %6d µs ± %5d µs  (standard error)\n" "$name (saved)" "$saved" \
+    "$error"
+  if [[ $((saved + 3 * error)) -lt 0 ]]; then
+    echo "$name: fast path is slower than the regular path by" \
+      "$((-saved)) µs" >&2
+    status=1
+  fi
+  return $status
+}
+
+compare "print param.sfo" "$2" || exit_code=1
+compare "query param.sfo" -q TITLE "$2" || exit_code=1
+compare "print PKG" "$3" || exit_code=1
+compare "query PKG" -q TITLE "$3" || exit_code=1
+exit $exit_code
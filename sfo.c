@@ -11,8 +11,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+// O_DIRECT is only defined with _GNU_SOURCE, which would conflict with this
+// program's basename()
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+#endif
+
 #if __has_include("<byteswap.h>")
 #include <byteswap.h>
 #else
@@ -21,6 +52,11 @@ uint32_t bswap_32(uint32_t val) {
   val = ((val << 8) & 0xFF00FF00 ) | ((val >> 8) & 0x00FF00FF );
   return (val << 16) | (val >> 16);
 }
+
+// Replacement function for byteswap.h's bswap_64
+uint64_t bswap_64(uint64_t val) {
+  return ((uint64_t) bswap_32(val) << 32) | bswap_32(val >> 32);
+}
 #endif
 
 // Global variables
@@ -33,6 +69,26 @@ int option_decimal;
 int option_force;
 int option_new_file;
 int option_verbose;
+char *watch_dir;
+#ifdef __linux__
+char temp_file_name[PATH_MAX];
+#endif
+char *extract_dir;
+int option_jobs;
+int option_stats;
+int option_check;
+int option_verify;
+int option_duplicates;
+int option_diff;
+int option_merge;
+int shard_index; // 0-based
+int shard_count;
+char *stats_report_format;
+char *spec_file_name;
+char *cache_file_name;
+double lock_timeout = -1;
+enum io_policy {io_default, io_fadvise, io_direct} io_policy;
+char *metrics_file_name;
 
 // Complete param.sfo file structure, 4 parts:
 // 1. header
@@ -72,9 +128,210 @@ struct command {
   } param;
 } *commands;
 int commands_count;
+int skipped_modifications;
+
+// Slack to leave in string parameters' .param_max_len, globally or per key
+double reserve_percent;
+struct reserve {
+  char *key;
+  uint32_t len;
+} *reserves;
+int reserves_count;
+#define MAX_RESERVE_LEN 65536 // Real param.sfo files are a few KiB in size
+int option_compact;
+
+char **input_files;
+int input_files_count;
+
+// PS4 PKG file table entry; all values are big-endian
+struct pkg_table_entry {
+  uint32_t id;
+  uint32_t filename_offset;
+  uint32_t flags1;
+  uint32_t flags2;
+  uint32_t offset;
+  uint32_t size;
+  uint64_t padding;
+};
+
+// Known PS4 PKG entry IDs
+struct pkg_entry_name {
+  uint32_t id;
+  char *name;
+} pkg_entry_names[] = {
+  {0x1000, "param.sfo"},
+  {0x1006, "pic1.png"},
+  {0x1200, "icon0.png"},
+  {0x1220, "pic0.png"},
+  {0x1240, "snd0.at9"},
+};
+
+uint32_t *extract_ids;
+int extract_ids_count;
+
+// Statistics for option --stats; on Linux, shared with child processes
+struct stats {
+  uint64_t arena_high_water_mark;
+  uint64_t arena_mallocs;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t bytes_read;
+} *stats;
+
+// What process_file() did while loading the current file, for option
+// --metrics-file: the error class of the current step (NULL once the file is
+// loaded), the bytes read, and when loading started and ended
+struct {
+  char *class;
+  uint64_t bytes_read;
+  struct timespec start;
+  struct timespec end;
+} load;
+
+// Bump-pointer arena that holds all per-file memory (index table, key table,
+// data table), so that loading and modifying a file needs (almost) no calls
+// to malloc(); reset before each file
+#define ARENA_CHUNK_SIZE 65536
+struct arena_chunk {
+  struct arena_chunk *prev;
+  size_t size;
+  size_t used;
+  char data[] __attribute__ ((aligned(16)));
+};
+struct {
+  struct arena_chunk *chunk;
+  void *last; // Most recent allocation, which can grow in place
+  size_t used;
+  size_t high_water_mark;
+} arena;
+
+// Each allocation is preceded by its size, for arena_realloc()
+struct arena_block {
+  size_t size;
+  char data[] __attribute__ ((aligned(16)));
+};
+
+// Atomically raises a shared statistics value to at least the given value
+static inline void stats_max(uint64_t *stat, uint64_t value) {
+  uint64_t old = __atomic_load_n(stat, __ATOMIC_RELAXED);
+  while (value > old && !__atomic_compare_exchange_n(stat, &old, value, 0,
+    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Adds a chunk of at least the needed size to the arena; returns 0 on success
+int arena_grow(size_t needed) {
+  size_t chunk_size = ARENA_CHUNK_SIZE;
+  while (chunk_size < needed) {
+    chunk_size *= 2;
+  }
+  struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+  if (chunk == NULL) {
+    return 1;
+  }
+  if (stats) __atomic_add_fetch(&stats->arena_mallocs, 1, __ATOMIC_RELAXED);
+  chunk->prev = arena.chunk;
+  chunk->size = chunk_size;
+  chunk->used = 0;
+  arena.chunk = chunk;
+  return 0;
+}
+
+// Allocates the arena's first chunk before child processes are created, so
+// that they inherit it instead of each allocating their own
+void arena_init(void) {
+  if (arena.chunk == NULL) {
+    arena_grow(0); // On failure, arena_alloc() tries again
+  }
+}
+
+// Returns arena memory, or NULL if the arena could not grow
+void *arena_alloc(size_t size) {
+  size_t needed = sizeof(struct arena_block) + ((size + 15) & ~(size_t) 15);
+  if ((arena.chunk == NULL || arena.chunk->size - arena.chunk->used < needed)
+    && arena_grow(needed)) {
+    return NULL;
+  }
+
+  struct arena_block *block =
+    (struct arena_block *) &arena.chunk->data[arena.chunk->used];
+  block->size = size;
+  arena.chunk->used += needed;
+  arena.last = block->data;
+  arena.used += needed;
+  if (arena.used > arena.high_water_mark) {
+    arena.high_water_mark = arena.used;
+  }
+  return block->data;
+}
+
+// Replacement for realloc() that uses the arena and exits on error; like
+// _realloc(), returns NULL if size is 0
+void *arena_realloc(void *ptr, size_t size) {
+  if (size == 0) {
+    return NULL; // Memory is reclaimed when the arena is reset
+  }
+
+  if (ptr) {
+    struct arena_block *block =
+      (struct arena_block *) ((char *) ptr - sizeof(struct arena_block));
+    // Grow or shrink the most recent allocation in place, if possible
+    if (ptr == arena.last) {
+      size_t old_size = (block->size + 15) & ~(size_t) 15;
+      size_t new_size = (size + 15) & ~(size_t) 15;
+      if (arena.chunk->used - old_size + new_size <= arena.chunk->size) {
+        arena.chunk->used = arena.chunk->used - old_size + new_size;
+        arena.used = arena.used - old_size + new_size;
+        if (arena.used > arena.high_water_mark) {
+          arena.high_water_mark = arena.used;
+        }
+        block->size = size;
+        return ptr;
+      }
+    }
+    void *new_ptr = arena_alloc(size);
+    if (new_ptr == NULL) {
+      fprintf(stderr, "Failed to reallocate memory.\n");
+      exit(1);
+    }
+    memcpy(new_ptr, ptr, block->size < size ? block->size : size);
+    return new_ptr;
+  }
+
+  if ((ptr = arena_alloc(size)) == NULL) {
+    fprintf(stderr, "Failed to reallocate memory.\n");
+    exit(1);
+  }
+  return ptr;
+}
+
+// Releases all arena memory, keeping only the most recent chunk for reuse
+void arena_reset(void) {
+  if (stats) stats_max(&stats->arena_high_water_mark, arena.high_water_mark);
+  if (arena.chunk) {
+    struct arena_chunk *chunk = arena.chunk->prev;
+    while (chunk) {
+      struct arena_chunk *prev = chunk->prev;
+      free(chunk);
+      chunk = prev;
+    }
+    arena.chunk->prev = NULL;
+    arena.chunk->used = 0;
+  }
+  arena.last = NULL;
+  arena.used = 0;
+  arena.high_water_mark = 0;
+}
+
+// Reads size bytes from a file, counting them; returns 0 on success
+int load_bytes(void *buf, size_t size, FILE *file) {
+  size_t len = fread(buf, 1, size, file);
+  load.bytes_read += len;
+  if (stats) __atomic_fetch_add(&stats->bytes_read, len, __ATOMIC_RELAXED);
+  return len != size;
+}
 
 void load_header(FILE *file) {
-  if (fread(&header, sizeof(struct header), 1, file) != 1) {
+  if (load_bytes(&header, sizeof(struct header), file)) {
     fprintf(stderr, "Could not read header.\n");
     exit(1);
   }
@@ -82,13 +339,13 @@ void load_header(FILE *file) {
 
 void load_entries(FILE *file) {
   unsigned int size = sizeof(struct index_table_entry) * header.entries_count;
-  entries = malloc(size);
+  entries = arena_alloc(size);
   if (entries == NULL) {
     fprintf(stderr, "Could not allocate %u bytes of memory for index table.\n",
       size);
     exit(1);
   }
-  if (size && fread(entries, size, 1, file) != 1) {
+  if (size && load_bytes(entries, size, file)) {
     fprintf(stderr, "Could not read index table entries.\n");
     exit(1);
   }
@@ -96,38 +353,207 @@ void load_entries(FILE *file) {
 
 void load_key_table(FILE *file) {
   key_table.size = header.data_table_offset - header.key_table_offset;
-  key_table.content = malloc(key_table.size);
+  key_table.content = arena_alloc(key_table.size);
   if (key_table.content == NULL) {
     fprintf(stderr, "Could not allocate %u bytes of memory for key table.\n",
       key_table.size);
     exit(1);
   }
-  if (key_table.size && fread(key_table.content, key_table.size, 1, file) != 1) {
+  if (key_table.size && load_bytes(key_table.content, key_table.size, file)) {
     fprintf(stderr, "Could not read key table.\n");
     exit(1);
   }
 }
 
-void load_data_table(FILE *file) {
+void load_data_table(FILE *file, uint64_t max_size) {
+  uint64_t size = 0; // For newly created, empty param.sfo files
   if (header.entries_count) {
-    data_table.size =
-      (entries[header.entries_count - 1].data_offset +
-      entries[header.entries_count - 1].param_max_len);
-  } else {
-    data_table.size = 0; // For newly created, empty param.sfo files
+    size = (uint64_t) entries[header.entries_count - 1].data_offset +
+      entries[header.entries_count - 1].param_max_len;
+  }
+  if (size > max_size) {
+    fprintf(stderr, "Invalid param.sfo: data table exceeds file size.\n");
+    exit(1);
   }
-  data_table.content = malloc(data_table.size);
+  data_table.size = size;
+  data_table.content = arena_alloc(data_table.size);
   if (data_table.content == NULL) {
     fprintf(stderr, "Could not allocate %u bytes of memory for data table.\n",
       data_table.size);
     exit(1);
   }
-  if (data_table.size && fread(data_table.content, data_table.size, 1, file) != 1) {
+  if (data_table.size && load_bytes(data_table.content, data_table.size,
+    file)) {
     fprintf(stderr, "Could not read data table.\n");
     exit(1);
   }
 }
 
+// Returns the position of the first NUL byte within len bytes, or len if there
+// is none
+size_t find_nul(const char *string, size_t len) {
+  size_t i = 0;
+#ifdef __AVX2__
+  __m256i zero32 = _mm256_setzero_si256();
+  for (; i + 32 <= len; i += 32) {
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+      _mm256_loadu_si256((__m256i *) &string[i]), zero32));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+#ifdef __SSE2__
+  __m128i zero16 = _mm_setzero_si128();
+  for (; i + 16 <= len; i += 16) {
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((__m128i *) &string[i]), zero16));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++) {
+    if (string[i] == '\0') return i;
+  }
+  return len;
+}
+
+// Returns 1 if len bytes are valid UTF-8 (no overlong encodings, surrogates,
+// or code points above U+10FFFF)
+int is_valid_utf8(const unsigned char *string, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    // Skip blocks of ASCII characters
+#ifdef __AVX2__
+    if (i + 32 <= len && _mm256_movemask_epi8(
+      _mm256_loadu_si256((__m256i *) &string[i])) == 0) {
+      i += 32;
+      continue;
+    }
+#endif
+#ifdef __SSE2__
+    if (i + 16 <= len && _mm_movemask_epi8(
+      _mm_loadu_si128((__m128i *) &string[i])) == 0) {
+      i += 16;
+      continue;
+    }
+#endif
+    if (string[i] < 0x80) {
+      i++;
+      continue;
+    }
+
+    int continuation_bytes;
+    uint32_t code_point, min;
+    if ((string[i] & 0xE0) == 0xC0) {
+      continuation_bytes = 1;
+      code_point = string[i] & 0x1F;
+      min = 0x80;
+    } else if ((string[i] & 0xF0) == 0xE0) {
+      continuation_bytes = 2;
+      code_point = string[i] & 0x0F;
+      min = 0x800;
+    } else if ((string[i] & 0xF8) == 0xF0) {
+      continuation_bytes = 3;
+      code_point = string[i] & 0x07;
+      min = 0x10000;
+    } else {
+      return 0;
+    }
+    if (len - i <= continuation_bytes) {
+      return 0;
+    }
+    for (int j = 1; j <= continuation_bytes; j++) {
+      if ((string[i + j] & 0xC0) != 0x80) {
+        return 0;
+      }
+      code_point = (code_point << 6) | (string[i + j] & 0x3F);
+    }
+    if (code_point < min || code_point > 0x10FFFF
+      || (code_point >= 0xD800 && code_point <= 0xDFFF)) {
+      return 0;
+    }
+    i += continuation_bytes + 1;
+  }
+  return 1;
+}
+
+// Checks the header's table offsets against the param.sfo's real size;
+// returns an error description or NULL
+char *validate_header(uint64_t sfo_size) {
+  if (header.key_table_offset < sizeof(struct header) +
+    (uint64_t) sizeof(struct index_table_entry) * header.entries_count) {
+    return "index table overlaps key table";
+  }
+  if (header.data_table_offset < header.key_table_offset) {
+    return "key table offset exceeds data table offset";
+  }
+  if (header.data_table_offset > sfo_size) {
+    return "tables exceed file size";
+  }
+  return NULL;
+}
+
+// Checks all index table entries against the key and data tables' sizes and
+// checks that their strings are terminated; returns an error description or
+// NULL
+char *validate_entries(void) {
+  static char error[64];
+  for (int i = 0; i < header.entries_count; i++) {
+    struct index_table_entry *entry = &entries[i];
+    if (entry->key_offset >= key_table.size
+      || find_nul(&key_table.content[entry->key_offset],
+      key_table.size - entry->key_offset) == key_table.size - entry->key_offset) {
+      snprintf(error, sizeof(error), "key of entry %d is out of bounds", i);
+      return error;
+    }
+    if ((uint64_t) entry->data_offset + entry->param_max_len > data_table.size) {
+      snprintf(error, sizeof(error), "data of entry %d is out of bounds", i);
+      return error;
+    }
+    if (entry->param_len > entry->param_max_len) {
+      snprintf(error, sizeof(error), "entry %d exceeds its maximum length", i);
+      return error;
+    }
+
+    char *data = &data_table.content[entry->data_offset];
+    switch (entry->param_fmt) {
+      case 516:
+      case 1024:
+        ;
+        size_t len = find_nul(data, entry->param_max_len);
+        if (len == entry->param_max_len) {
+          snprintf(error, sizeof(error), "string of entry %d is not terminated",
+            i);
+          return error;
+        }
+        break;
+      case 1028:
+        if (entry->param_max_len < 4) {
+          snprintf(error, sizeof(error), "integer of entry %d is too short", i);
+          return error;
+        }
+        break;
+    }
+  }
+  return NULL;
+}
+
+// Checks that the strings of entries validated by validate_entries() are valid
+// UTF-8; returns an error description or NULL. Not fatal when loading, so that
+// such files can still be read and repaired.
+char *validate_strings(void) {
+  static char error[64];
+  for (int i = 0; i < header.entries_count; i++) {
+    if (entries[i].param_fmt != 516) continue;
+    char *data = &data_table.content[entries[i].data_offset];
+    if (!is_valid_utf8((unsigned char *) data,
+      find_nul(data, entries[i].param_max_len))) {
+      snprintf(error, sizeof(error), "string of entry %d is not valid UTF-8",
+        i);
+      return error;
+    }
+  }
+  return NULL;
+}
+
 // Debug function that prints a byte array's content in hex editor style
 void hexprint(char *array, int array_len) {
   int offset = 0;
@@ -227,9 +653,50 @@ void print_data_table(void) {
   fprintf(stderr, "\n");
 }
 
-// Saves all 4 param.sfo parts to a param.sfo file
+// Saves all 4 param.sfo parts to a param.sfo file. On Linux, the file is
+// replaced atomically; a symbolic link's target is replaced instead of the
+// link, and files with multiple hard links are overwritten in place (like on
+// other systems), as replacing them would break the links.
 void save_to_file(char *file_name) {
+#ifdef __linux__
+  char path[PATH_MAX];
+  if (realpath(file_name, path) == NULL) { // New file
+    snprintf(path, sizeof(path), "%s", file_name);
+  }
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  int fd = -1;
+  FILE *file = NULL;
+  if (exists && st.st_nlink > 1) {
+    file = fopen(path, "wb");
+  } else {
+    // Write to a temporary file that replaces the original file only after
+    // all data has been written, so that no other process ever sees a
+    // partial file
+    if (snprintf(temp_file_name, sizeof(temp_file_name), "%s.XXXXXX", path)
+      >= sizeof(temp_file_name)) {
+      temp_file_name[0] = '\0'; // Not to be deleted by clean_exit()
+      fprintf(stderr, "File name \"%s\" is too long.\n", file_name);
+      exit(1);
+    }
+    fd = mkstemp(temp_file_name);
+    if (fd == -1) {
+      temp_file_name[0] = '\0';
+    } else {
+      // mkstemp() creates files with mode 0600; keep the original file's mode
+      if (exists) {
+        fchmod(fd, st.st_mode & 07777);
+      } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+      }
+      file = fdopen(fd, "wb");
+    }
+  }
+#else
   FILE *file = fopen(file_name, "wb");
+#endif
   if (file == NULL) {
     fprintf(stderr, "Could not open file \"%s\" in write mode.\n", file_name);
     exit(1);
@@ -258,7 +725,22 @@ void save_to_file(char *file_name) {
     exit(1);
   }
 
+#ifdef __linux__
+  if (fflush(file) || fsync(fileno(file))) {
+    fprintf(stderr, "Could not write to file \"%s\".\n", file_name);
+    exit(1);
+  }
   fclose(file);
+  if (fd != -1) {
+    if (rename(temp_file_name, path)) {
+      fprintf(stderr, "Could not replace file \"%s\".\n", file_name);
+      exit(1);
+    }
+    temp_file_name[0] = '\0';
+  }
+#else
+  fclose(file);
+#endif
 }
 
 // Prints a single parameter
@@ -364,7 +846,7 @@ static inline void *_realloc(void *ptr, unsigned int size) {
 // Resizes the data table, starting at specified offset
 void expand_data_table(int offset, int additional_size) {
   data_table.size += additional_size;
-  data_table.content = _realloc(data_table.content, data_table.size);
+  data_table.content = arena_realloc(data_table.content, data_table.size);
   // Move higher indexed data to make room for new data
   for (int i = data_table.size - 1; i >= offset + additional_size; i--) {
     data_table.content[i] = data_table.content[i - additional_size];
@@ -373,6 +855,36 @@ void expand_data_table(int offset, int additional_size) {
   memset(&data_table.content[offset], 0, additional_size);
 }
 
+// Changes a parameter's .param_max_len (rounded up to 4-byte alignment),
+// resizing the data table accordingly
+void resize_param(int index, uint32_t param_max_len) {
+  uint64_t aligned_len = ((uint64_t) param_max_len + 3) / 4 * 4;
+  if (aligned_len + data_table.size - entries[index].param_max_len
+    > UINT32_MAX - sizeof(struct header)) {
+    fprintf(stderr, "Could not resize \"%s\": data table would exceed "
+      "4 GiB.\n", &key_table.content[entries[index].key_offset]);
+    exit(1);
+  }
+  int64_t diff = (int64_t) aligned_len - entries[index].param_max_len;
+  uint32_t offset = entries[index].data_offset + entries[index].param_max_len;
+
+  if (diff > 0) {
+    expand_data_table(offset, diff);
+  } else if (diff < 0) {
+    // Move higher indexed data down, over the unneeded space
+    memmove(&data_table.content[offset + diff], &data_table.content[offset],
+      data_table.size - offset);
+    data_table.size += diff;
+    data_table.content = arena_realloc(data_table.content, data_table.size);
+  }
+  entries[index].param_max_len = aligned_len;
+
+  // Adjust follow-up index table entries' data offsets
+  for (int i = index + 1; i < header.entries_count; i++) {
+    entries[i].data_offset += diff;
+  }
+}
+
 // Returns a parameter's index table position
 int get_index(char *key) {
   for (int i = 0; i < header.entries_count; i++) {
@@ -383,40 +895,36 @@ int get_index(char *key) {
   return -1;
 }
 
-// Edits a parameter in memory
-void edit_param(char *key, char *value, int no_fail) {
+// Edits a parameter in memory; returns 1 if the edit was skipped
+int edit_param(char *key, char *value, int no_fail) {
   int index = get_index(key);
   if (index < 0) { // Parameter not found
     if (no_fail) {
-      return;
+      return 1;
     } else {
       fprintf(stderr, "Could not edit \"%s\": parameter not found.\n", key);
       exit(1);
     }
   }
 
+  if (entries[index].param_fmt == 516
+    && !is_valid_utf8((unsigned char *) value, strlen(value))) {
+    if (no_fail) {
+      return 1;
+    } else {
+      fprintf(stderr, "Could not edit \"%s\": value is not valid UTF-8.\n",
+        key);
+      exit(1);
+    }
+  }
+
   switch (entries[index].param_fmt) {
     case 516: // String
     case 1024: // Special mode string
       entries[index].param_len = strlen(value) + 1;
       // Enlarge data table if new string is longer than allowed
-      int diff = entries[index].param_len - entries[index].param_max_len;
-      if (diff > 0) {
-        int offset = entries[index].data_offset + entries[index].param_max_len;
-        entries[index].param_max_len = entries[index].param_len;
-
-        // 4-byte alignment
-        while (entries[index].param_max_len % 4) {
-          entries[index].param_max_len++;
-          diff++;
-        }
-
-        expand_data_table(offset, diff);
-
-        // Adjust follow-up index table entries' data offsets
-        for (int i = index + 1; i < header.entries_count; i++) {
-          entries[i].data_offset += diff;
-        }
+      if (entries[index].param_len > entries[index].param_max_len) {
+        resize_param(index, entries[index].param_len);
       }
       // Overwrite old data with zeros
       memset(&data_table.content[entries[index].data_offset], 0,
@@ -431,6 +939,7 @@ void edit_param(char *key, char *value, int no_fail) {
       memcpy(&data_table.content[entries[index].data_offset], &integer, 4);
       break;
   }
+  return 0;
 }
 
 // Pad a table to obey the 4-byte alignment rule
@@ -442,21 +951,21 @@ void pad_table(struct table *table) {
   }
   if (table->size) table->size++; // Re-add 1 zero if there are strings left
 
-  table->content = _realloc(table->content, table->size);
+  table->content = arena_realloc(table->content, table->size);
   // Pad table with zeros
   while (table->size % 4) {
     table->size++;
-    table->content = _realloc(table->content, table->size);
+    table->content = arena_realloc(table->content, table->size);
     table->content[table->size - 1] = '\0';
   }
 }
 
-// Deletes a parameter from memory
-void delete_param(char *key, int no_fail) {
+// Deletes a parameter from memory; returns 1 if the deletion was skipped
+int delete_param(char *key, int no_fail) {
   int index = get_index(key);
   if (index < 0) { // Parameter not found
     if (no_fail) {
-      return;
+      return 1;
     } else {
       fprintf(stderr, "Could not delete \"%s\": parameter not found.\n", key);
       exit(1);
@@ -470,7 +979,7 @@ void delete_param(char *key, int no_fail) {
 
   // Resize key table
   key_table.size -= strlen(key) + 1;
-  key_table.content = _realloc(key_table.content, key_table.size);
+  key_table.content = arena_realloc(key_table.content, key_table.size);
   pad_table(&key_table);
 
   // Delete parameter from data table
@@ -481,9 +990,8 @@ void delete_param(char *key, int no_fail) {
   // Resize data table
   data_table.size -= entries[index].param_max_len;
   if (data_table.size) {
-    data_table.content = _realloc(data_table.content, data_table.size);
+    data_table.content = arena_realloc(data_table.content, data_table.size);
   } else {
-    free(data_table.content);
     data_table.content = NULL;
   }
 
@@ -498,12 +1006,12 @@ void delete_param(char *key, int no_fail) {
   // Resize index table
   header.entries_count--;
   if (header.entries_count) {
-    entries = _realloc(entries,
+    entries = arena_realloc(entries,
       sizeof(struct index_table_entry) * header.entries_count);
   } else {
-    free(entries);
     entries = NULL;
   }
+  return 0;
 }
 
 // Checks if key is reserved and returns its default length
@@ -566,11 +1074,62 @@ int get_reserved_string_len(char *key) {
   return len;
 }
 
-// Adds a new parameter to memory
-void add_param(char *type, char *key, char *value, int no_fail) {
+// Applies options --compact and --reserve to all string parameters
+void resize_params(void) {
+  for (int i = 0; i < header.entries_count; i++) {
+    if (entries[i].param_fmt != 516 && entries[i].param_fmt != 1024) {
+      continue;
+    }
+    char *key = &key_table.content[entries[i].key_offset];
+
+    // Shrink to the string's length, but not below the reserved default
+    if (option_compact) {
+      uint32_t len = get_reserved_string_len(key);
+      if (len < entries[i].param_len) {
+        len = entries[i].param_len;
+      }
+      if (len < entries[i].param_max_len) {
+        resize_param(i, len);
+      }
+    }
+
+    // Grow to leave room for future edits; a key's own value has precedence
+    double percent_len = entries[i].param_len +
+      (uint64_t) (entries[i].param_len * reserve_percent / 100);
+    uint32_t len = percent_len < MAX_RESERVE_LEN ? percent_len
+      : MAX_RESERVE_LEN;
+    for (int j = 0; j < reserves_count; j++) {
+      if (!strcmp(key, reserves[j].key)) {
+        len = reserves[j].len;
+      }
+    }
+    if (len > entries[i].param_max_len) {
+      resize_param(i, len);
+    }
+  }
+}
+
+// Returns 1 if any option that modifies data has been specified
+int has_modifications(void) {
+  return commands_count || option_compact || reserve_percent || reserves_count;
+}
+
+// Adds a new parameter to memory; returns 1 if the addition was skipped
+int add_param(char *type, char *key, char *value, int no_fail) {
   struct index_table_entry new_entry = {0};
   int new_index = 0;
 
+  if (!strcmp(type, "str")
+    && !is_valid_utf8((unsigned char *) value, strlen(value))) {
+    if (no_fail) {
+      return 1;
+    } else {
+      fprintf(stderr, "Could not add \"%s\": value is not valid UTF-8.\n",
+        key);
+      exit(1);
+    }
+  }
+
   // Get new entry's .param_len and .param_max_len
   if (!strcmp(type, "str")) {
     new_entry.param_fmt = 516;
@@ -594,7 +1153,7 @@ void add_param(char *type, char *key, char *value, int no_fail) {
     int result = strcmp(key, &key_table.content[entries[i].key_offset]);
     if (result == 0) { // Parameter already exists
       if (no_fail) {
-        return;
+        return 1;
       } else {
         fprintf(stderr, "Could not add \"%s\": parameter already exists.\n", key);
         exit(1);
@@ -616,7 +1175,7 @@ void add_param(char *type, char *key, char *value, int no_fail) {
 
   // Make room for the new index table entry by moving the old ones
   header.entries_count++;
-  entries = _realloc(entries,
+  entries = arena_realloc(entries,
     sizeof(struct index_table_entry) * header.entries_count);
   for (int i = header.entries_count - 1; i > new_index; i--) {
     entries[i] = entries[i - 1];
@@ -629,7 +1188,7 @@ void add_param(char *type, char *key, char *value, int no_fail) {
 
   // Resize key table
   key_table.size += strlen(key) + 1;
-  key_table.content = _realloc(key_table.content, key_table.size);
+  key_table.content = arena_realloc(key_table.content, key_table.size);
   // Move higher indexed keys to make room for new key
   for (int i = key_table.size - 1; i > new_entry.key_offset + strlen(key); i--) {
     key_table.content[i] = key_table.content[i - strlen(key) - 1];
@@ -652,10 +1211,16 @@ void add_param(char *type, char *key, char *value, int no_fail) {
     memcpy(&data_table.content[entries[new_index].data_offset],
       &new_value, 4);
   }
+  return 0;
 }
 
 // Overwrites an existing parameter or creates a new one
 void set_param(char *type, char *key, char *value) {
+  if (!strcmp(type, "str")
+    && !is_valid_utf8((unsigned char *) value, strlen(value))) {
+    fprintf(stderr, "Could not set \"%s\": value is not valid UTF-8.\n", key);
+    exit(1);
+  }
   delete_param(key, 1);
   add_param(type, key, value, 1);
 }
@@ -684,7 +1249,15 @@ void print_usage(int exit_code) {
     output = stdout;
   }
   fprintf(output,
-  "Usage: %s [OPTIONS] FILE\n\n"
+  "Usage: %s [OPTIONS] FILE\n"
+  "       %s [OPTIONS] MODIFICATION_OPTIONS FILE...\n"
+  "       %s --extract DIRECTORY [OPTIONS] PKG_FILE...\n"
+  "       %s --check [OPTIONS] FILE...\n"
+  "       %s --duplicates [OPTIONS] FILE...\n"
+  "       %s --diff [OPTIONS] FILE1 FILE2...\n"
+  "       %s --stats-report FORMAT [OPTIONS] FILE...\n"
+  "       %s --merge [OPTIONS] CACHE_FILE...\n"
+  "       %s --build-from SPEC_FILE [OPTIONS]\n\n"
   "Reads a file to print or modify its SFO parameters.\n"
   "Supported file types:\n"
   "  - PS4 param.sfo (print and modify)\n"
@@ -700,64 +1273,268 @@ void print_usage(int exit_code) {
   "  Delete        Parameter not found\n"
   "  Edit          Parameter not found\n"
   "  Set           None\n\n"
+  "If multiple files are specified, the modifications are applied to each file\n"
+  "separately and in parallel, followed by a report of succeeded, partial\n"
+  "(written, but some modifications skipped due to -f/--force), and failed\n"
+  "files. Error messages are prefixed with the file name.\n\n"
   "Options:\n"
   "  -a, --add TYPE PARAMETER VALUE  Add a new parameter, not overwriting existing\n"
   "                                  data. TYPE must be either \"int\" or \"str\".\n"
+  "      --build-from SPEC_FILE      Create the param.sfo files described by\n"
+  "                                  SPEC_FILE (\"-\" reads standard input) in\n"
+  "                                  parallel. Each line consists of the file's\n"
+  "                                  name, TYPE, PARAMETER, and VALUE (see\n"
+  "                                  --add), separated by tabs. Fails for\n"
+  "                                  existing files unless --force is used.\n"
+  "      --cache CACHE_FILE          With options --diff (more than 2 files),\n"
+  "                                  --duplicates, or --stats-report, store each\n"
+  "                                  file's summary in CACHE_FILE and only read\n"
+  "                                  files that have changed since the last run.\n"
+  "                                  With option --watch, keep the summaries of\n"
+  "                                  DIRECTORY's files up to date, writing\n"
+  "                                  CACHE_FILE at most every 5 seconds.\n"
+  "      --check                     Check files for truncation and corruption,\n"
+  "                                  in parallel, reading only metadata. Prints\n"
+  "                                  a line per file: error class (\"ok\", \"io\",\n"
+  "                                  \"truncated\", \"magic\", \"pkg_table\",\n"
+  "                                  \"sfo_header\", \"sfo_index\", \"digest\", or\n"
+  "                                  \"utf8\"), file name, and error description,\n"
+  "                                  separated by tabs.\n"
+  "      --compact                   After all other modifications, shrink string\n"
+  "                                  parameters' maximum lengths to their current\n"
+  "                                  lengths or reserved defaults.\n"
   "  -d, --delete PARAMETER          Delete specified parameter.\n"
   "      --debug                     Print debug information.\n"
   "      --decimal                   Display integer values as decimal numerals.\n"
+  "      --diff                      Print the differences between 2 files, or\n"
+  "                                  between files with the same TITLE_ID, in\n"
+  "                                  order of APP_VER. Prints a line \"diff\",\n"
+  "                                  FILE1, FILE2, followed by lines \"added\",\n"
+  "                                  \"removed\", \"changed\", \"type\", or\n"
+  "                                  \"max_len\", PARAMETER, and the values, all\n"
+  "                                  separated by tabs.\n"
+  "      --duplicates                Print groups of files with identical\n"
+  "                                  parameters (\"duplicate\", fingerprint, file\n"
+  "                                  name) and groups of files with the same\n"
+  "                                  CONTENT_ID but different APP_VER\n"
+  "                                  (\"outdated\" or \"newest\", CONTENT_ID,\n"
+  "                                  APP_VER, file name), separated by tabs.\n"
   "  -e, --edit PARAMETER VALUE      Change specified parameter's value.\n"
+  "      --entry ID                  Entry to extract with option --extract\n"
+  "                                  (default: param.sfo). ID is either a number\n"
+  "                                  or one of param.sfo, pic1.png, icon0.png,\n"
+  "                                  pic0.png, snd0.at9. Can be used multiple\n"
+  "                                  times.\n"
+  "      --extract DIRECTORY         Copy entries of the PKG files to\n"
+  "                                  DIRECTORY/PKG_NAME/, processing multiple\n"
+  "                                  files in parallel. Fails if PKG files have\n"
+  "                                  the same PKG_NAME.\n"
   "  -f, --force                     Do not abort when modifications fail. Make\n"
   "                                  option --new-file overwrite existing files.\n"
   "  -h, --help                      Print usage information and quit.\n"
+  "      --io-policy POLICY          How options --check, --diff, --duplicates,\n"
+  "                                  --stats-report, and --verify read files:\n"
+  "                                  \"default\", \"fadvise\" (no readahead, and\n"
+  "                                  afterwards drop the pages that were not\n"
+  "                                  already in the page cache), or \"direct\"\n"
+  "                                  (bypass the page cache with O_DIRECT).\n"
+  "  -j, --jobs N                    Process up to N files in parallel (default:\n"
+  "                                  number of CPUs).\n"
+  "      --lock-timeout SECONDS      Wait at most SECONDS for other sfo processes\n"
+  "                                  to release the file (default: wait\n"
+  "                                  indefinitely). 0 fails immediately.\n"
+  "      --merge                     Read CACHE_FILEs written by runs with\n"
+  "                                  options --shard and --cache instead of\n"
+  "                                  files, and combine them into the output of\n"
+  "                                  a single run (options --diff, --duplicates,\n"
+  "                                  --stats-report) or into a new cache file\n"
+  "                                  (option --cache).\n"
+  "      --metrics-file FILE         While processing files in parallel or\n"
+  "                                  watching a directory, write live metrics\n"
+  "                                  (files per second, bytes read, errors per\n"
+  "                                  class, cache hits, queue depth, latency\n"
+  "                                  histograms) to FILE every second, in\n"
+  "                                  Prometheus text format.\n"
   "      --new-file                  If FILE (see above) does not exist, create a\n"
   "                                  new param.sfo file of the same name.\n"
   "  -o, --output-file OUTPUT_FILE   Save the final data to a new file of type\n"
   "                                  \"param.sfo\", overwriting existing files.\n"
   "  -q, --query PARAMETER           Print a parameter's value and quit.\n"
   "                                  If the parameter exists, the exit code is 0.\n"
+  "      --reserve PERCENT           After all other modifications, make sure\n"
+  "      --reserve PARAMETER=LENGTH  string parameters can grow by PERCENT of their\n"
+  "                                  current lengths, or PARAMETER up to LENGTH\n"
+  "                                  bytes, so future edits will not move other\n"
+  "                                  parameters. Can be used multiple times.\n"
+  "                                  Lengths are limited to 65536 bytes.\n"
   "  -s, --set TYPE PARAMETER VALUE  Set a parameter, whether it exists or not,\n"
   "                                  overwriting existing data.\n"
+  "      --shard K/N                 Process only the K-th of N parts of the\n"
+  "                                  input files, by a hash of their names. With\n"
+  "                                  options --diff, --duplicates, or\n"
+  "                                  --stats-report, only write the part's\n"
+  "                                  records to CACHE_FILE (see --merge). With\n"
+  "                                  options --diff and --merge, only print the\n"
+  "                                  K-th of N consecutive parts of the diffs.\n"
+  "      --stats                     Print statistics (e.g. bytes read) to\n"
+  "                                  stderr when finished.\n"
+  "      --stats-report FORMAT       Print the number of files per CATEGORY,\n"
+  "                                  APP_VER (per TITLE_ID), required firmware\n"
+  "                                  version (SYSTEM_VER), and parameter, reading\n"
+  "                                  files in parallel. FORMAT is either \"json\"\n"
+  "                                  or \"table\" (tab-separated lines).\n"
   "  -v, --verbose                   Increase verbosity.\n"
+  "      --verify                    Like --check, but also verify each PKG file's\n"
+  "                                  param.sfo against the PKG's SHA-256 digest\n"
+  "                                  table.\n"
   "      --version                   Print version information and quit.\n"
-  ,basename(program_name));
+  "      --watch DIRECTORY           Print the parameters of all files inside\n"
+  "                                  DIRECTORY and its subdirectories, then keep\n"
+  "                                  watching them and print only files that are\n"
+  "                                  written to or moved in (or report files\n"
+  "                                  moved out or deleted).\n"
+  ,basename(program_name), basename(program_name),
+  basename(program_name), basename(program_name), basename(program_name),
+  basename(program_name), basename(program_name), basename(program_name),
+  basename(program_name));
   exit(exit_code);
 }
 
+// Prints statistics for option --stats
+void print_stats(void) {
+  arena_reset(); // Publishes the current file's arena usage
+  fprintf(stderr, "Arena high-water mark: %llu bytes\n",
+    (unsigned long long) stats->arena_high_water_mark);
+  fprintf(stderr, "Arena memory allocations: %llu\n",
+    (unsigned long long) stats->arena_mallocs);
+  fprintf(stderr, "Bytes read: %llu\n",
+    (unsigned long long) stats->bytes_read);
+  if (cache_file_name) {
+    fprintf(stderr, "Cache hits: %llu\n",
+      (unsigned long long) stats->cache_hits);
+    fprintf(stderr, "Cache misses: %llu\n",
+      (unsigned long long) stats->cache_misses);
+  }
+}
+
 void print_version(void) {
   printf("SFO v%s\n", program_version);
   printf("https://github.com/hippie68/sfo\n");
 }
 
+// Returns a file's size, or 0 on error
+uint64_t get_file_size(FILE *file) {
+#if defined(_WIN32) || defined(_WIN64)
+  struct _stat64 st;
+  if (_fstat64(_fileno(file), &st)) return 0;
+#else
+  struct stat st;
+  if (fstat(fileno(file), &st)) return 0;
+#endif
+  return st.st_size;
+}
+
+// PS4 PKG file table parsing, shared by all code that reads PKG files; the
+// callers do the reading
+
+// Gets the entry count and offset of a PS4 PKG file's file table from the
+// first PKG_HEADER_SIZE bytes of the file; returns an error description if
+// the table exceeds the file size
+#define PKG_HEADER_SIZE 32
+char *get_pkg_table(const unsigned char *pkg_header, uint64_t file_size,
+  uint32_t *count, uint32_t *offset) {
+  memcpy(count, &pkg_header[0x00C], 4);
+  memcpy(offset, &pkg_header[0x018], 4);
+  *count = bswap_32(*count);
+  *offset = bswap_32(*offset);
+  if (*offset + (uint64_t) sizeof(struct pkg_table_entry) * *count
+    > file_size) {
+    return "file table exceeds file size";
+  }
+  return NULL;
+}
+
+// Returns whether a PS4 PKG file table entry's data exceeds the file size
+int pkg_entry_exceeds(struct pkg_table_entry *entry, uint64_t file_size) {
+  return (uint64_t) bswap_32(entry->offset) + bswap_32(entry->size)
+    > file_size;
+}
+
+// Searches (a part of) a PS4 PKG file table for an entry ID; returns the
+// entry's index or -1
+int find_pkg_entry(struct pkg_table_entry *table, uint32_t count,
+  uint32_t id) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (bswap_32(table[i].id) == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 // Finds the param.sfo's offset inside a PS4 PKG file
-long int get_ps4_pkg_offset() {
-  uint32_t pkg_table_offset;
-  uint32_t pkg_file_count;
-  fseek(file, 0x00C, SEEK_SET);
-  fread(&pkg_file_count, 4, 1, file);
-  fseek(file, 0x018, SEEK_SET);
-  fread(&pkg_table_offset, 4, 1, file);
-  pkg_file_count = bswap_32(pkg_file_count);
-  pkg_table_offset = bswap_32(pkg_table_offset);
-  struct pkg_table_entry {
-    uint32_t id;
-    uint32_t filename_offset;
-    uint32_t flags1;
-    uint32_t flags2;
-    uint32_t offset;
-    uint32_t size;
-    uint64_t padding;
-  } pkg_table_entry[pkg_file_count];
+// and stores the param.sfo's size
+long int get_ps4_pkg_offset(uint64_t file_size, uint64_t *sfo_size) {
+  unsigned char pkg_header[PKG_HEADER_SIZE];
+  uint32_t pkg_file_count, pkg_table_offset;
+  char *error = "file is too small";
+  rewind(file);
+  if (load_bytes(pkg_header, sizeof(pkg_header), file)
+    || (error = get_pkg_table(pkg_header, file_size, &pkg_file_count,
+    &pkg_table_offset))) {
+    fprintf(stderr, "Invalid PS4 PKG: %s.\n", error);
+    exit(1);
+  }
+  uint64_t size = (uint64_t) sizeof(struct pkg_table_entry) * pkg_file_count;
+  struct pkg_table_entry *table = arena_alloc(size);
+  if (table == NULL) {
+    fprintf(stderr, "Could not allocate %llu bytes of memory for PKG file "
+      "table.\n", (unsigned long long) size);
+    exit(1);
+  }
   fseek(file, pkg_table_offset, SEEK_SET);
-  fread(pkg_table_entry, sizeof (struct pkg_table_entry), pkg_file_count, file);
-  for (int i = 0; i < pkg_file_count; i++) {
-    if (pkg_table_entry[i].id == 1048576) { // param.sfo ID
-      return bswap_32(pkg_table_entry[i].offset);
+  if (size && load_bytes(table, size, file)) {
+    fprintf(stderr, "Could not read PKG file table.\n");
+    exit(1);
+  }
+  int index = find_pkg_entry(table, pkg_file_count, 0x1000); // param.sfo
+  if (index == -1) {
+    fprintf(stderr, "Could not find a param.sfo file inside the PS4 PKG.\n");
+    exit(1);
+  }
+  if (pkg_entry_exceeds(&table[index], file_size)) {
+    fprintf(stderr, "Invalid PS4 PKG: param.sfo exceeds file size.\n");
+    exit(1);
+  }
+  *sfo_size = bswap_32(table[index].size);
+  return bswap_32(table[index].offset);
+}
+
+// Parses a PKG entry ID, given as number or as known entry name
+int parse_pkg_entry_id(char *string, uint32_t *id) {
+  for (int i = 0; i < sizeof(pkg_entry_names) / sizeof(pkg_entry_names[0]);
+    i++) {
+    if (!strcmp(string, pkg_entry_names[i].name)) {
+      *id = pkg_entry_names[i].id;
+      return 0;
     }
   }
-  fprintf(stderr, "Could not find a param.sfo file inside the PS4 PKG.\n");
-  fclose(file);
-  exit(1);
+  char *end;
+  *id = strtoul(string, &end, 0);
+  if (*string == '\0' || *end != '\0') {
+    return 1;
+  }
+  return 0;
+}
+
+// Returns the 64-bit FNV-1a hash of a memory block, continuing from hash
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
 }
 
 // Removes the leftmost argument from argv; decrements argc
@@ -785,10 +1562,15 @@ void toupper_string(char *string) {
 // Frees all previously malloc'ed pointers; used for memory leak tests
 void clean_exit(void) {
   if (commands) free(commands);
-  if (entries) free(entries);
-  if (key_table.content) free(key_table.content);
-  if (data_table.content) free(data_table.content);
+  if (reserves) free(reserves);
+  if (input_files) free(input_files);
+  if (extract_ids) free(extract_ids);
+  arena_reset();
+  if (arena.chunk) free(arena.chunk);
   if (file) fclose(file);
+#ifdef __linux__
+  if (temp_file_name[0]) unlink(temp_file_name); // Unfinished save_to_file()
+#endif
 }
 
 // Creates an empty param.sfo file
@@ -801,58 +1583,3069 @@ void create_param_sfo(char *file_name) {
   save_to_file(file_name);
 }
 
-int main(int argc, char *argv[]) {
-  atexit(clean_exit);
+#ifdef __linux__
+// Acquires an advisory lock, waiting at most lock_timeout seconds (or
+// indefinitely if lock_timeout is negative); returns 0 on success
+int acquire_lock(int fd, int operation, struct timespec *deadline) {
+  if (lock_timeout < 0) {
+    while (flock(fd, operation)) {
+      if (errno != EINTR) return 1;
+    }
+    return 0;
+  }
 
-  char *input_file_name = NULL;
-  char *output_file_name = NULL;
+  while (flock(fd, operation | LOCK_NB)) {
+    if (errno != EWOULDBLOCK) return 1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec
+      && now.tv_nsec >= deadline->tv_nsec)) {
+      return 1;
+    }
+    usleep(10000);
+  }
+  return 0;
+}
 
-  // Parse command line arguments
-  program_name = argv[0];
-  shift(&argc, &argv);
-  while (argc) {
-    // Parse file names
-    if (argv[0][0] != '-') {
-      if (input_file_name == NULL) {
-        input_file_name = argv[0];
-      } else {
-        fprintf(stderr, "Only 1 input file is allowed. Conflicting file names:\n"
-          "  \"%s\"\n  \"%s\"\n", input_file_name, argv[0]);
-        print_usage(1);
-      }
-    // Parse options
-    } else if (!strcmp(argv[0], "-a") || !strcmp(argv[0], "--add")) {
-      commands = _realloc(commands, sizeof(struct command) * (commands_count + 1));
-      commands[commands_count].cmd = cmd_add;
-      shift(&argc, &argv);
-      // TYPE
-      if (strcmp(argv[0], "str") && strcmp(argv[0], "int")) {
-        fprintf(stderr, "Option --add: TYPE must be \"int\" or \"str\".\n");
-        print_usage(1);
-      }
-      commands[commands_count].param.type = argv[0];
-      shift(&argc, &argv);
-      // NAME
-      toupper_string(argv[0]);
-      commands[commands_count].param.key = argv[0];
-      shift(&argc, &argv);
-      // VALUE
-      commands[commands_count].param.value = argv[0];
-      commands_count++;
-    } else if (!strcmp(argv[0], "--new-file")) {
-      option_new_file = 1;
-    } else if (!strcmp(argv[0], "-d") || !strcmp(argv[0], "--delete")) {
-      commands = _realloc(commands, sizeof(struct command) * (commands_count + 1));
-      commands[commands_count].cmd = cmd_delete;
-      shift(&argc, &argv);
-      // NAME
-      toupper_string(argv[0]);
-      commands[commands_count].param.key = argv[0];
+// Locks the opened input file, shared for reading or exclusive for modifying;
+// reopens it if another process has replaced it while waiting for the lock
+void lock_file(char *file_name, int operation) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t) lock_timeout;
+  deadline.tv_nsec += (long) ((lock_timeout - (time_t) lock_timeout) * 1e9);
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  while (1) {
+    if (acquire_lock(fileno(file), operation, &deadline)) {
+      fprintf(stderr, "Could not lock file \"%s\".\n", file_name);
+      exit(1);
+    }
+
+    // save_to_file() replaces files instead of overwriting them, so the lock
+    // is only valid if the file name still refers to the locked file
+    struct stat locked, current;
+    if (fstat(fileno(file), &locked) == 0 && stat(file_name, &current) == 0
+      && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+      return;
+    }
+    fclose(file);
+    file = fopen(file_name, "rb");
+    if (file == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", file_name);
+      exit(1);
+    }
+  }
+}
+#endif
+
+// Prints or modifies a single file's SFO parameters; returns the exit code
+int process_file(char *input_file_name, char *output_file_name) {
+  arena_reset();
+
+  // Optionally create file before opening it
+  if (option_new_file) {
+    if (!option_force && !access(input_file_name, F_OK)) {
+      fprintf(stderr, "File \"%s\" already exists.\n", input_file_name);
+      exit(1);
+    } else {
+      create_param_sfo(input_file_name);
+    }
+  }
+  load.class = "io";
+  file = fopen(input_file_name, "rb"); // Read only
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", input_file_name);
+    exit(1);
+  }
+#ifdef __linux__
+  // Held until the process exits, covering the whole read-modify-write cycle
+  lock_file(input_file_name, has_modifications() ? LOCK_EX : LOCK_SH);
+  clock_gettime(CLOCK_MONOTONIC, &load.start);
+#endif
+
+  // Get SFO header offset and size
+  uint32_t magic = 0;
+  uint64_t sfo_size = get_file_size(file);
+  load.class = "magic";
+  load_bytes(&magic, 4, file);
+  if (magic == 1414415231) { // PS4 PKG file
+    // Like check_fd_metadata(), blame a file shorter than the PKG header on
+    // truncation
+    load.class = sfo_size < 0x1000 ? "truncated" : "pkg_table";
+    fseek(file, get_ps4_pkg_offset(sfo_size, &sfo_size), SEEK_SET);
+  } else if (magic == 1128612691) { // Disc param.sfo
+    fseek(file, 0x800, SEEK_SET);
+    sfo_size = sfo_size > 0x800 ? sfo_size - 0x800 : 0;
+  } else if (magic == 1179865088) { // Param.sfo file
+    rewind(file);
+  } else {
+    fprintf(stderr, "Param.sfo magic number not found.\n");
+    exit(1);
+  }
+
+  // Load and validate file contents
+  char *error;
+  load.class = "sfo_header";
+  load_header(file);
+  if ((error = validate_header(sfo_size))) {
+    fprintf(stderr, "Invalid param.sfo: %s.\n", error);
+    exit(1);
+  }
+  load_entries(file);
+  load_key_table(file);
+  load_data_table(file, sfo_size - header.data_table_offset);
+  load.class = "sfo_index";
+  if ((error = validate_entries())) {
+    fprintf(stderr, "Invalid param.sfo: %s.\n", error);
+    exit(1);
+  }
+  if ((error = validate_strings())) {
+    fprintf(stderr, "Warning: %s.\n", error);
+  }
+  load.class = NULL;
+#ifdef __linux__
+  clock_gettime(CLOCK_MONOTONIC, &load.end);
+#endif
+
+  if (option_debug) {
+    fprintf(stderr, "Memory before running commands:\n\n");
+    print_header();
+    print_entries();
+    print_key_table();
+    print_data_table();
+  }
+
+  // If there are any queued commands, run them and save the file
+  if (has_modifications()) {
+    if (magic == 1414415231) {
+      fprintf(stderr, "Cannot edit PKG files.\n");
+      exit(1);
+    }
+    if (magic == 1128612691) {
+      fprintf(stderr, "Cannot edit disc param.sfo files.\n");
+      exit(1);
+    }
+
+    for (int i = 0; i < commands_count; i++) {
+      switch (commands[i].cmd) {
+        case cmd_add:
+          skipped_modifications += add_param(commands[i].param.type,
+            commands[i].param.key, commands[i].param.value, option_force);
+          break;
+        case cmd_delete:
+          skipped_modifications += delete_param(commands[i].param.key,
+            option_force);
+          break;
+        case cmd_edit:
+          skipped_modifications += edit_param(commands[i].param.key,
+            commands[i].param.value, option_force);
+          break;
+        case cmd_set:
+          set_param(commands[i].param.type, commands[i].param.key,
+            commands[i].param.value);
+          break;
+      }
+    }
+    resize_params();
+
+    if (option_debug) {
+      fprintf(stderr, "Memory after running commands:\n\n"
+        "Header's table offsets will be updated when saving the file.\n\n");
+      print_header();
+      print_entries();
+      print_key_table();
+      print_data_table();
+    }
+
+    if (output_file_name) {
+      save_to_file(output_file_name);
+    } else {
+      save_to_file(input_file_name);
+    }
+
+    if (query_string) {
+      return print_param(query_string);
+    }
+  } else {
+    if (output_file_name) {
+      save_to_file(output_file_name);
+    }
+
+    if (query_string) {
+      return print_param(query_string);
+    } else {
+      print_params();
+    }
+  }
+
+  return 0;
+}
+
+#ifdef __linux__
+// Live metrics for option --metrics-file. Each job slot has its own counters
+// in shared memory, written only by the child process currently running in
+// that slot (and the last slot only by the parent process), so no locks are
+// needed; the parent sums all slots when writing the metrics file.
+#define METRICS_INTERVAL 1 // Seconds between writes of the metrics file
+#define METRICS_BUCKETS 13
+static const double metrics_buckets[METRICS_BUCKETS] = {0.0001, 0.00025,
+  0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1};
+static char *error_classes[] = {"io", "truncated", "magic", "pkg_table",
+  "sfo_header", "sfo_index", "digest", "utf8"};
+#define ERROR_CLASSES (sizeof(error_classes) / sizeof(error_classes[0]))
+
+struct histogram {
+  uint64_t buckets[METRICS_BUCKETS + 1]; // Not cumulative; last one is +Inf
+  uint64_t sum; // Nanoseconds
+};
+
+struct metrics_slot {
+  uint64_t files;
+  uint64_t bytes_read;
+  uint64_t errors[ERROR_CLASSES];
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  struct histogram parse;
+  struct histogram job;
+} *metrics;
+int metrics_slot; // This process's slot
+int metrics_queued; // Files waiting for a job slot (parent only)
+int metrics_running; // Running jobs (parent only)
+struct timespec metrics_start; // When the program started
+struct timespec metrics_written; // When the metrics file was last written
+
+// Adds a value to one of this process's counters
+void metrics_add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+    __ATOMIC_RELAXED);
+}
+
+// Returns the nanoseconds since a point in time
+uint64_t nanoseconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ULL
+    + now.tv_nsec - start->tv_nsec;
+}
+
+// Records a duration in nanoseconds in a histogram
+void metrics_observe_ns(struct histogram *histogram, uint64_t ns) {
+  int i = 0;
+  while (i < METRICS_BUCKETS && ns > metrics_buckets[i] * 1e9) {
+    i++;
+  }
+  metrics_add(&histogram->buckets[i], 1);
+  metrics_add(&histogram->sum, ns);
+}
+
+// Records the duration of an event that started at start in a histogram
+void metrics_observe(struct histogram *histogram, struct timespec *start) {
+  metrics_observe_ns(histogram, nanoseconds_since(start));
+}
+
+// Allocates the metrics' shared memory; the parent process uses the last slot
+void init_metrics(void) {
+  metrics = mmap(NULL, sizeof(struct metrics_slot) * (option_jobs + 1),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (metrics == MAP_FAILED) {
+    fprintf(stderr, "Could not allocate memory for metrics.\n");
+    exit(1);
+  }
+  metrics_slot = option_jobs;
+  clock_gettime(CLOCK_MONOTONIC, &metrics_start);
+}
+
+// Prints a histogram's lines in Prometheus text format
+void print_histogram(FILE *file, char *name, char *help,
+  struct histogram *histogram) {
+  fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint64_t count = 0;
+  for (int i = 0; i <= METRICS_BUCKETS; i++) {
+    count += histogram->buckets[i];
+    if (i < METRICS_BUCKETS) {
+      fprintf(file, "%s_bucket{le=\"%g\"} %llu\n", name, metrics_buckets[i],
+        (unsigned long long) count);
+    } else {
+      fprintf(file, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+        (unsigned long long) count);
+    }
+  }
+  fprintf(file, "%s_sum %.9f\n%s_count %llu\n", name, histogram->sum / 1e9,
+    name, (unsigned long long) count);
+}
+
+// Sums all slots' metrics and writes them to the metrics file in Prometheus
+// text format, replacing the file atomically
+void write_metrics(void) {
+  struct metrics_slot total = {0};
+  for (int i = 0; i <= option_jobs; i++) {
+    uint64_t *from = (uint64_t *) &metrics[i], *to = (uint64_t *) &total;
+    for (int j = 0; j < sizeof(struct metrics_slot) / sizeof(uint64_t); j++) {
+      to[j] += __atomic_load_n(&from[j], __ATOMIC_RELAXED);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &metrics_written);
+  double seconds = nanoseconds_since(&metrics_start) / 1e9;
+
+  char temp_name[PATH_MAX];
+  snprintf(temp_name, sizeof(temp_name), "%s.XXXXXX", metrics_file_name);
+  int fd = mkstemp(temp_name);
+  FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\" in write mode.\n",
+      metrics_file_name);
+    exit(1);
+  }
+  fchmod(fd, 0644);
+  fprintf(file, "# HELP sfo_files_total "
+    "Files processed by batch jobs or watch events.\n"
+    "# TYPE sfo_files_total counter\nsfo_files_total %llu\n",
+    (unsigned long long) total.files);
+  fprintf(file, "# HELP sfo_files_per_second Files processed per second since "
+    "the start.\n# TYPE sfo_files_per_second gauge\n"
+    "sfo_files_per_second %.3f\n", seconds > 0 ? total.files / seconds : 0);
+  fprintf(file, "# HELP sfo_bytes_read_total Bytes read by scans.\n"
+    "# TYPE sfo_bytes_read_total counter\nsfo_bytes_read_total %llu\n",
+    (unsigned long long) total.bytes_read);
+  fprintf(file, "# HELP sfo_errors_total Files that failed to parse, by error "
+    "class.\n# TYPE sfo_errors_total counter\n");
+  for (int i = 0; i < ERROR_CLASSES; i++) {
+    fprintf(file, "sfo_errors_total{class=\"%s\"} %llu\n", error_classes[i],
+      (unsigned long long) total.errors[i]);
+  }
+  fprintf(file, "# HELP sfo_cache_hits_total Files whose record was taken "
+    "from the scan cache.\n# TYPE sfo_cache_hits_total counter\n"
+    "sfo_cache_hits_total %llu\n", (unsigned long long) total.cache_hits);
+  fprintf(file, "# HELP sfo_cache_misses_total Files that had to be read "
+    "despite the scan cache.\n# TYPE sfo_cache_misses_total counter\n"
+    "sfo_cache_misses_total %llu\n", (unsigned long long) total.cache_misses);
+  fprintf(file, "# HELP sfo_queue_depth Files waiting for a job slot.\n"
+    "# TYPE sfo_queue_depth gauge\nsfo_queue_depth %d\n", metrics_queued);
+  fprintf(file, "# HELP sfo_jobs_running Running batch jobs.\n"
+    "# TYPE sfo_jobs_running gauge\nsfo_jobs_running %d\n", metrics_running);
+  print_histogram(file, "sfo_parse_duration_seconds",
+    "Time to read and validate a file's metadata.", &total.parse);
+  print_histogram(file, "sfo_job_duration_seconds",
+    "Time to process a file in a batch job or watch event.", &total.job);
+  if (fclose(file) || rename(temp_name, metrics_file_name)) {
+    fprintf(stderr, "Could not write to file \"%s\".\n", metrics_file_name);
+    unlink(temp_name);
+    exit(1);
+  }
+}
+
+int job_index; // Index of the file a batch job's child process works on
+
+// If set, run_jobs() prints the jobs' standard output in the order of the
+// files instead of in the order the jobs finish: each job writes to its
+// slot's temporary file, then appends the output as a single record to
+// output_fd, like record_file() does with results_fd
+int ordered_output;
+int output_fd = -1;
+
+// Header of a job's output record
+struct output_record {
+  int job_index;
+  uint32_t len;
+};
+
+// Appends a job's output, collected in its standard output file, to
+// output_fd; runs when the job's process exits
+void append_job_output(void) {
+  fflush(stdout);
+  off_t len = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+  if (len <= 0) {
+    return;
+  }
+  size_t size = sizeof(struct output_record) + len;
+  struct output_record *record = malloc(size);
+  if (record == NULL) {
+    fprintf(stderr, "Could not allocate %zu bytes of memory for job output.\n",
+      size);
+    return;
+  }
+  record->job_index = job_index;
+  record->len = len;
+  // A single write() to a file opened with O_APPEND is never interleaved
+  if (pread(STDOUT_FILENO, &record[1], len, 0) != len
+    || write(output_fd, record, size) != size) {
+    fprintf(stderr, "Could not write job output.\n");
+  }
+  free(record);
+}
+
+// Prints the output records in output_fd in the order of the jobs
+void print_job_outputs(int jobs_count) {
+  off_t *offsets = _realloc(NULL, sizeof(off_t) * (jobs_count + 1));
+  for (int i = 0; i < jobs_count; i++) {
+    offsets[i] = -1;
+  }
+  struct output_record record;
+  off_t offset = 0;
+  while (pread(output_fd, &record, sizeof(record), offset) == sizeof(record)) {
+    if (record.job_index >= 0 && record.job_index < jobs_count) {
+      offsets[record.job_index] = offset;
+    }
+    offset += sizeof(record) + record.len;
+  }
+
+  char buf[65536];
+  for (int i = 0; i < jobs_count; i++) {
+    if (offsets[i] == -1) {
+      continue;
+    }
+    pread(output_fd, &record, sizeof(record), offsets[i]);
+    offset = offsets[i] + sizeof(record);
+    for (uint32_t done = 0; done < record.len;) {
+      size_t size = record.len - done < sizeof(buf) ? record.len - done
+        : sizeof(buf);
+      ssize_t len = pread(output_fd, buf, size, offset + done);
+      if (len <= 0) {
+        fprintf(stderr, "Could not read job output.\n");
+        exit(1);
+      }
+      fwrite(buf, 1, len, stdout);
+      done += len;
+    }
+  }
+  free(offsets);
+}
+
+// Runs job() for each file in child processes, at most option_jobs at a time,
+// and stores each child's exit code
+void run_jobs(int (*job)(char *), char **file_names, int files_count,
+  int *exit_codes) {
+  struct {
+    pid_t pid; // 0 if the slot is free
+    int file_index;
+    FILE *output; // With ordered_output, the standard output of its jobs
+  } slots[option_jobs];
+  memset(slots, 0, sizeof(slots));
+  int running = 0;
+  int next = 0;
+  arena_init();
+
+  FILE *outputs = NULL;
+  if (ordered_output) {
+    outputs = tmpfile();
+    if (outputs == NULL) {
+      fprintf(stderr, "Could not create temporary file.\n");
+      exit(1);
+    }
+    output_fd = fileno(outputs);
+    fcntl(output_fd, F_SETFL, fcntl(output_fd, F_GETFL) | O_APPEND);
+  }
+
+  // With option --metrics-file, wait for children with sigtimedwait(), so the
+  // metrics file can be written in between
+  sigset_t sigchld, old_mask;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  if (metrics) {
+    sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+  }
+
+  while (next < files_count || running) {
+    if (metrics) {
+      metrics_queued = files_count - next;
+      metrics_running = running;
+      if (nanoseconds_since(&metrics_written) >= METRICS_INTERVAL
+        * 1000000000ULL) {
+        write_metrics();
+      }
+    }
+    if (next < files_count && running < option_jobs) {
+      int slot = 0;
+      while (slots[slot].pid) slot++;
+      if (ordered_output && slots[slot].output == NULL
+        && (slots[slot].output = tmpfile()) == NULL) {
+        fprintf(stderr, "Could not create temporary file.\n");
+        exit(1);
+      }
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == -1) {
+        fprintf(stderr, "Could not create child process.\n");
+        exit(1);
+      } else if (pid == 0) {
+        // Let the job's output be written at once when the child exits
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+        job_index = next;
+        if (ordered_output) {
+          int fd = fileno(slots[slot].output);
+          if (lseek(fd, 0, SEEK_SET) || ftruncate(fd, 0)
+            || dup2(fd, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "Could not redirect job output.\n");
+            exit(1);
+          }
+          atexit(append_job_output);
+        }
+        if (metrics) {
+          sigprocmask(SIG_SETMASK, &old_mask, NULL);
+          metrics_slot = slot;
+          struct timespec start;
+          clock_gettime(CLOCK_MONOTONIC, &start);
+          int exit_code = job(file_names[next]);
+          metrics_observe(&metrics[slot].job, &start);
+          metrics_add(&metrics[slot].files, 1);
+          exit(exit_code);
+        }
+        exit(job(file_names[next]));
+      }
+      slots[slot].pid = pid;
+      slots[slot].file_index = next;
+      running++;
+      next++;
+    } else {
+      int status;
+      pid_t pid;
+      if (metrics) {
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+          struct timespec timeout = {.tv_sec = METRICS_INTERVAL};
+          sigtimedwait(&sigchld, NULL, &timeout);
+          continue;
+        }
+      } else {
+        pid = wait(&status);
+      }
+      if (pid == -1) {
+        fprintf(stderr, "Could not wait for child process.\n");
+        exit(1);
+      }
+      for (int i = 0; i < option_jobs; i++) {
+        if (slots[i].pid == pid) {
+          exit_codes[slots[i].file_index] =
+            WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+          slots[i].pid = 0;
+          running--;
+          break;
+        }
+      }
+    }
+  }
+
+  if (metrics) {
+    metrics_queued = 0;
+    metrics_running = 0;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  }
+  if (ordered_output) {
+    print_job_outputs(files_count);
+    for (int i = 0; i < option_jobs; i++) {
+      if (slots[i].output) fclose(slots[i].output);
+    }
+    fclose(outputs);
+    output_fd = -1;
+  }
+}
+
+// SHA-256 (FIPS 180-4) of a memory block
+void sha256(const void *data, size_t len, uint8_t digest[32]) {
+  static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+  uint32_t h[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+    0x1f83d9ab, 0x5be0cd19
+  };
+  const uint8_t *bytes = data;
+  uint8_t block[64];
+  size_t total_blocks = (len + 9 + 63) / 64; // Including padding
+
+  for (size_t n = 0; n < total_blocks; n++) {
+    // Build the block, appending 0x80, zeros, and the bit length at the end
+    for (int i = 0; i < 64; i++) {
+      size_t pos = n * 64 + i;
+      if (pos < len) {
+        block[i] = bytes[pos];
+      } else if (pos == len) {
+        block[i] = 0x80;
+      } else if (n == total_blocks - 1 && i >= 56) {
+        block[i] = (uint64_t) len * 8 >> (8 * (63 - i));
+      } else {
+        block[i] = 0;
+      }
+    }
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t) block[i * 4] << 24 | block[i * 4 + 1] << 16 |
+        block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = (w[i - 15] >> 7 | w[i - 15] << 25) ^
+        (w[i - 15] >> 18 | w[i - 15] << 14) ^ (w[i - 15] >> 3);
+      uint32_t s1 = (w[i - 2] >> 17 | w[i - 2] << 15) ^
+        (w[i - 2] >> 19 | w[i - 2] << 13) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5],
+      g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = (e >> 6 | e << 26) ^ (e >> 11 | e << 21) ^
+        (e >> 25 | e << 7);
+      uint32_t t1 = hh + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      uint32_t s0 = (a >> 2 | a << 30) ^ (a >> 13 | a << 19) ^
+        (a >> 22 | a << 10);
+      uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = h[i] >> 24;
+    digest[i * 4 + 1] = h[i] >> 16;
+    digest[i * 4 + 2] = h[i] >> 8;
+    digest[i * 4 + 3] = h[i];
+  }
+}
+
+// Bounce buffer for the file opened with O_DIRECT, whose reads must be aligned
+// to the storage's block size; holds the most recently read blocks
+#define DIRECT_IO_ALIGNMENT 4096
+struct {
+  char data[65536] __attribute__((aligned(DIRECT_IO_ALIGNMENT)));
+  int fd;
+  uint64_t offset;
+  size_t len;
+} direct_io = {.fd = -1};
+
+// Page ranges that reads from the file opened with option --io-policy fadvise
+// brought into the page cache; further pages stay cached if the list is full
+#define SCAN_READS_MAX 16
+struct {
+  int fd;
+  int count;
+  struct {
+    uint64_t offset;
+    uint64_t len;
+  } ranges[SCAN_READS_MAX];
+} scan_reads = {.fd = -1};
+
+// Opens a file for a scan, according to option --io-policy; returns the file
+// descriptor or -1
+int open_scan_file(char *file_name) {
+  int fd;
+  if (io_policy == io_direct) {
+    fd = open(file_name, O_RDONLY | O_DIRECT);
+    if (fd != -1) {
+      direct_io.fd = fd;
+      direct_io.len = 0;
+      return fd;
+    }
+    if (errno != EINVAL) {
+      return -1;
+    }
+    // The file system does not support O_DIRECT (e.g. tmpfs)
+  }
+  fd = open(file_name, O_RDONLY);
+  if (fd != -1 && io_policy != io_default) {
+    // Only the few KiB of metadata are needed, so readahead is wasted
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    scan_reads.fd = fd;
+    scan_reads.count = 0;
+  }
+  return fd;
+}
+
+// Remembers which pages of the file opened with open_scan_file() a read will
+// bring into the page cache, skipping pages that are already cached, so that
+// close_scan_file() drops only those
+void note_scan_read(int fd, size_t size, uint64_t offset) {
+  static long page_size;
+  if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+  uint64_t start = offset / page_size * page_size;
+  uint64_t end = (offset + size + page_size - 1) / page_size * page_size;
+  void *map = mmap(NULL, end - start, PROT_READ, MAP_SHARED, fd, start);
+  if (map == MAP_FAILED) return; // Dropping nothing is the safe choice
+
+  unsigned char resident[64];
+  uint64_t chunk_size = sizeof(resident) * page_size;
+  for (uint64_t chunk = start; chunk < end; chunk += chunk_size) {
+    uint64_t pages = (end - chunk) / page_size;
+    if (pages > sizeof(resident)) pages = sizeof(resident);
+    if (mincore((char *) map + (chunk - start), pages * page_size, resident)) {
+      break;
+    }
+    for (uint64_t i = 0; i < pages; i++) {
+      if (resident[i] & 1) continue;
+      uint64_t page = chunk + i * page_size;
+      if (scan_reads.count && scan_reads.ranges[scan_reads.count - 1].offset
+        + scan_reads.ranges[scan_reads.count - 1].len == page) {
+        scan_reads.ranges[scan_reads.count - 1].len += page_size;
+      } else if (scan_reads.count < SCAN_READS_MAX) {
+        scan_reads.ranges[scan_reads.count].offset = page;
+        scan_reads.ranges[scan_reads.count].len = page_size;
+        scan_reads.count++;
+      }
+    }
+  }
+  munmap(map, end - start);
+}
+
+// Closes a file opened with open_scan_file(), dropping the pages its reads
+// brought into the page cache if option --io-policy requires it
+void close_scan_file(int fd) {
+  if (fd == direct_io.fd) {
+    direct_io.fd = -1;
+  } else if (fd == scan_reads.fd) {
+    for (int i = 0; i < scan_reads.count; i++) {
+      posix_fadvise(fd, scan_reads.ranges[i].offset, scan_reads.ranges[i].len,
+        POSIX_FADV_DONTNEED);
+    }
+    scan_reads.fd = -1;
+  }
+  close(fd);
+}
+
+// Reads from the file opened with O_DIRECT through the bounce buffer; returns
+// 0 on success
+int read_direct(int fd, void *buf, size_t size, uint64_t offset) {
+  while (size) {
+    if (offset < direct_io.offset
+      || offset >= direct_io.offset + direct_io.len) {
+      // Read all blocks of the requested range that fit into the buffer
+      uint64_t start = offset / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+      uint64_t end = (offset + size + DIRECT_IO_ALIGNMENT - 1)
+        / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+      if (end - start > sizeof(direct_io.data)) {
+        end = start + sizeof(direct_io.data);
+      }
+      ssize_t len;
+      do {
+        len = pread(fd, direct_io.data, end - start, start);
+      } while (len == -1 && errno == EINTR);
+      if (len <= 0) {
+        direct_io.len = 0;
+        return 1;
+      }
+      if (stats) __atomic_fetch_add(&stats->bytes_read, len, __ATOMIC_RELAXED);
+      if (metrics) metrics_add(&metrics[metrics_slot].bytes_read, len);
+      direct_io.offset = start;
+      direct_io.len = len;
+      if (offset >= start + len) { // End of file
+        return 1;
+      }
+    }
+    size_t len = direct_io.offset + direct_io.len - offset;
+    if (len > size) len = size;
+    memcpy(buf, &direct_io.data[offset - direct_io.offset], len);
+    buf = (char *) buf + len;
+    size -= len;
+    offset += len;
+  }
+  return 0;
+}
+
+// Reads exactly size bytes at offset; returns 0 on success
+int read_at(int fd, void *buf, size_t size, uint64_t offset) {
+  if (fd == direct_io.fd) {
+    return read_direct(fd, buf, size, offset);
+  }
+  if (fd == scan_reads.fd) {
+    note_scan_read(fd, size, offset);
+  }
+  while (size) {
+    ssize_t len = pread(fd, buf, size, offset);
+    if (len == -1 && errno == EINTR) continue;
+    if (len <= 0) return 1;
+    if (stats) __atomic_fetch_add(&stats->bytes_read, len, __ATOMIC_RELAXED);
+    if (metrics) metrics_add(&metrics[metrics_slot].bytes_read, len);
+    buf = (char *) buf + len;
+    size -= len;
+    offset += len;
+  }
+  return 0;
+}
+
+// Checks a file's metadata, reading only the PKG header, the PKG file table,
+// and the param.sfo; returns the error class ("ok" if there is no error) and
+// stores a description of the error
+char *check_fd_metadata(int fd, char **error) {
+  struct stat st;
+  if (fstat(fd, &st)) {
+    *error = "could not get file size";
+    return "io";
+  }
+  uint64_t file_size = st.st_size;
+
+  uint32_t magic;
+  if (read_at(fd, &magic, 4, 0)) {
+    *error = "file is too small";
+    return "truncated";
+  }
+
+  uint64_t sfo_offset, sfo_size;
+  if (magic == 1414415231) { // PS4 PKG file
+    unsigned char pkg_header[PKG_HEADER_SIZE];
+    uint64_t pkg_body[4]; // Body offset and size, content offset and size
+    if (read_at(fd, pkg_header, sizeof(pkg_header), 0)
+      || read_at(fd, pkg_body, sizeof(pkg_body), 0x020)) {
+      *error = "PKG header is incomplete";
+      return "truncated";
+    }
+
+    // A file that is shorter than its header (0x1000 bytes) or than the body
+    // and content the header describes has been cut off, which also explains
+    // a file table that exceeds the file size
+    int truncated = file_size < 0x1000;
+    for (int i = 0; i < 4; i += 2) {
+      if (bswap_64(pkg_body[i]) > file_size
+        || bswap_64(pkg_body[i + 1]) > file_size - bswap_64(pkg_body[i])) {
+        truncated = 1;
+      }
+    }
+    char *table_class = truncated ? "truncated" : "pkg_table";
+
+    uint32_t pkg_file_count, pkg_table_offset;
+    if ((*error = get_pkg_table(pkg_header, file_size, &pkg_file_count,
+      &pkg_table_offset))) {
+      return table_class;
+    }
+    uint64_t size = (uint64_t) sizeof(struct pkg_table_entry) * pkg_file_count;
+    struct pkg_table_entry *table = arena_alloc(size);
+    if (table == NULL || read_at(fd, table, size, pkg_table_offset)) {
+      *error = "could not read file table";
+      return "io";
+    }
+
+    for (int i = 0; i < pkg_file_count; i++) {
+      if (pkg_entry_exceeds(&table[i], file_size)) {
+        *error = "file table entry exceeds file size";
+        return table_class;
+      }
+    }
+    int sfo_index = find_pkg_entry(table, pkg_file_count, 0x1000);
+    if (sfo_index == -1) {
+      *error = "no param.sfo found";
+      return "pkg_table";
+    }
+    sfo_offset = bswap_32(table[sfo_index].offset);
+    sfo_size = bswap_32(table[sfo_index].size);
+
+    // Compare the param.sfo's SHA-256 with the one in the digest table (entry
+    // ID 0x0001), which holds a digest for each file table entry, in order
+    if (option_verify) {
+      int digests_index = find_pkg_entry(table, pkg_file_count, 0x0001);
+      if (digests_index == -1 || (uint64_t) (sfo_index + 1) * 32
+        > bswap_32(table[digests_index].size)) {
+        *error = "no param.sfo digest found";
+        return "pkg_table";
+      }
+      uint8_t expected[32], actual[32];
+      char *sfo = arena_alloc(sfo_size);
+      if (sfo == NULL || read_at(fd, sfo, sfo_size, sfo_offset)
+        || read_at(fd, expected, 32, bswap_32(table[digests_index].offset)
+        + (uint64_t) sfo_index * 32)) {
+        *error = "could not read param.sfo or its digest";
+        return "io";
+      }
+      sha256(sfo, sfo_size, actual);
+      if (memcmp(expected, actual, 32)) {
+        *error = "param.sfo does not match its digest";
+        return "digest";
+      }
+    }
+
+    // The payload is never read, but must be complete
+    if (truncated) {
+      *error = file_size < 0x1000 ? "PKG header is incomplete"
+        : "body or content exceeds file size";
+      return "truncated";
+    }
+  } else if (magic == 1128612691) { // Disc param.sfo
+    sfo_offset = 0x800;
+    sfo_size = file_size > 0x800 ? file_size - 0x800 : 0;
+  } else if (magic == 1179865088) { // Param.sfo file
+    sfo_offset = 0;
+    sfo_size = file_size;
+  } else {
+    *error = "param.sfo magic number not found";
+    return "magic";
+  }
+
+  if (read_at(fd, &header, sizeof(struct header), sfo_offset)) {
+    *error = "param.sfo header is incomplete";
+    return "truncated";
+  }
+  if (header.magic != 1179865088) {
+    *error = "param.sfo magic number not found";
+    return "magic";
+  }
+  if ((*error = validate_header(sfo_size))) {
+    return "sfo_header";
+  }
+
+  // Load the tables like load_*(), but at the offsets given by the header
+  key_table.size = header.data_table_offset - header.key_table_offset;
+  entries = arena_alloc(sizeof(struct index_table_entry) *
+    header.entries_count);
+  key_table.content = arena_alloc(key_table.size);
+  if (entries == NULL || key_table.content == NULL
+    || read_at(fd, entries, sizeof(struct index_table_entry) *
+    header.entries_count, sfo_offset + sizeof(struct header))
+    || read_at(fd, key_table.content, key_table.size,
+    sfo_offset + header.key_table_offset)) {
+    *error = "could not read index table or key table";
+    return "io";
+  }
+  uint64_t size = 0;
+  if (header.entries_count) {
+    size = (uint64_t) entries[header.entries_count - 1].data_offset +
+      entries[header.entries_count - 1].param_max_len;
+  }
+  if (header.data_table_offset + size > sfo_size) {
+    *error = "data table exceeds file size";
+    return "sfo_header";
+  }
+  data_table.size = size;
+  data_table.content = arena_alloc(data_table.size);
+  if (data_table.content == NULL || read_at(fd, data_table.content,
+    data_table.size, sfo_offset + header.data_table_offset)) {
+    *error = "could not read data table";
+    return "io";
+  }
+  if ((*error = validate_entries())) {
+    return "sfo_index";
+  }
+
+  *error = NULL;
+  return "ok";
+}
+
+// Counts the error class of a file that failed to open or parse
+void metrics_error(char *class) {
+  if (metrics == NULL) {
+    return;
+  }
+  for (int i = 0; i < ERROR_CLASSES; i++) {
+    if (!strcmp(class, error_classes[i])) {
+      metrics_add(&metrics[metrics_slot].errors[i], 1);
+    }
+  }
+}
+
+// Like check_fd_metadata(), but also records metrics
+char *check_fd(int fd, char **error) {
+  if (metrics == NULL) {
+    return check_fd_metadata(fd, error);
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char *class = check_fd_metadata(fd, error);
+  metrics_observe(&metrics[metrics_slot].parse, &start);
+  metrics_error(class);
+  return class;
+}
+
+// Opens a file and checks it with check_fd(); returns the error class and
+// stores a description of the error
+char *check_path(char *file_name, char **error) {
+  char *class;
+  int fd = open_scan_file(file_name);
+  if (fd == -1) {
+    class = "io";
+    *error = strerror(errno);
+    metrics_error(class);
+  } else {
+    class = check_fd(fd, error);
+    close_scan_file(fd);
+  }
+  return class;
+}
+
+// Batch job that prints a file's check result as a line of tab-separated
+// fields: error class, file name, and (for errors) a description
+int check_file(char *file_name) {
+  char *error;
+  char *class = check_path(file_name, &error);
+  if (!strcmp(class, "ok") && (error = validate_strings())) {
+    class = "utf8";
+    metrics_error(class);
+  }
+  if (error) {
+    printf("%s\t%s\t%s\n", class, file_name, error);
+    return 1;
+  }
+  printf("%s\t%s\n", class, file_name);
+  return 0;
+}
+
+// Checks all input files in parallel; returns the exit code
+int check_files(void) {
+  int *exit_codes = _realloc(NULL, sizeof(int) * input_files_count);
+  ordered_output = 1;
+  run_jobs(check_file, input_files, input_files_count, exit_codes);
+  ordered_output = 0;
+  int exit_code = 0;
+  for (int i = 0; i < input_files_count; i++) {
+    if (exit_codes[i]) {
+      exit_code = 1;
+    }
+  }
+  free(exit_codes);
+  return exit_code;
+}
+
+// Summary of a file's SFO parameters, as stored in the scan cache
+struct record {
+  char *line; // Tab-separated fields, with each field's tab replaced by '\0'
+  int64_t mtime; // Nanoseconds
+  uint64_t size;
+  uint64_t fingerprint;
+  char *content_id;
+  char *title_id;
+  char *app_ver;
+  char *category;
+  char *system_ver; // 8 hexadecimal digits, or "" if missing
+  char *keys; // Comma-separated
+  char *path;
+};
+
+#define CACHE_HEADER "# sfo cache 3\n"
+#define RECORD_FIELDS 10
+
+int results_fd = -1; // Batch jobs append records to this file
+
+// Compares two index table entries by key, for qsort()
+int compare_entries(const void *a, const void *b) {
+  return strcmp(&key_table.content[((struct index_table_entry *) a)->key_offset],
+    &key_table.content[((struct index_table_entry *) b)->key_offset]);
+}
+
+// Stores a fingerprint of the loaded parameters that only depends on their
+// keys, formats, and values, not on the file's layout; returns 0 on success
+int get_fingerprint(uint64_t *fingerprint) {
+  size_t size = sizeof(struct index_table_entry) * header.entries_count;
+  struct index_table_entry *sorted = arena_alloc(size);
+  if (sorted == NULL) {
+    return 1;
+  }
+  memcpy(sorted, entries, size);
+  qsort(sorted, header.entries_count, sizeof(struct index_table_entry),
+    compare_entries);
+
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int i = 0; i < header.entries_count; i++) {
+    char *key = &key_table.content[sorted[i].key_offset];
+    char *data = &data_table.content[sorted[i].data_offset];
+    hash = fnv1a(hash, key, strlen(key) + 1);
+    hash = fnv1a(hash, &sorted[i].param_fmt, sizeof(sorted[i].param_fmt));
+    if (sorted[i].param_fmt == 1028) {
+      hash = fnv1a(hash, data, 4);
+    } else {
+      hash = fnv1a(hash, data, find_nul(data, sorted[i].param_max_len) + 1);
+    }
+  }
+  *fingerprint = hash;
+  return 0;
+}
+
+// Returns a loaded string parameter's value, with tabs and newlines replaced
+// so it can be stored in a record; returns "" if the parameter is missing
+char *get_record_field(char *key) {
+  int index = get_index(key);
+  if (index < 0 || entries[index].param_fmt == 1028) {
+    return "";
+  }
+  char *value = &data_table.content[entries[index].data_offset];
+  for (char *c = value; *c; c++) {
+    if (*c == '\t' || *c == '\n') *c = ' ';
+  }
+  return value;
+}
+
+// Writes a record as a line of tab-separated fields; returns the line's length
+// like snprintf()
+int format_record(char *line, size_t size, struct record *record) {
+  return snprintf(line, size,
+    "%lld\t%llu\t%016llx\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+    (long long) record->mtime, (unsigned long long) record->size,
+    (unsigned long long) record->fingerprint, record->content_id,
+    record->title_id, record->app_ver, record->category, record->system_ver,
+    record->keys, record->path);
+}
+
+// Returns the loaded parameters' keys, separated by commas, in arena memory
+char *get_record_keys(void) {
+  size_t size = 1;
+  for (int i = 0; i < header.entries_count; i++) {
+    size += strlen(&key_table.content[entries[i].key_offset]) + 1;
+  }
+  char *keys = arena_alloc(size);
+  if (keys == NULL) {
+    return "";
+  }
+  char *p = keys;
+  for (int i = 0; i < header.entries_count; i++) {
+    for (char *c = &key_table.content[entries[i].key_offset]; *c; c++) {
+      *p++ = *c == ',' || *c == '\t' || *c == '\n' ? ' ' : *c;
+    }
+    *p++ = ',';
+  }
+  p[header.entries_count ? -1 : 0] = '\0';
+  return keys;
+}
+
+// Appends the record of a file whose parameters are loaded to results_fd;
+// returns 0 on success
+int write_record(char *file_name, struct stat *st) {
+  char system_ver[9] = "";
+  int index = get_index("SYSTEM_VER");
+  if (index >= 0 && entries[index].param_fmt == 1028) {
+    uint32_t integer;
+    memcpy(&integer, &data_table.content[entries[index].data_offset], 4);
+    snprintf(system_ver, sizeof(system_ver), "%08x", integer);
+  }
+
+  // Before get_record_field() replaces tabs and newlines in the values (the
+  // evaluation order of initializers is unspecified)
+  uint64_t fingerprint;
+  if (get_fingerprint(&fingerprint)) {
+    fprintf(stderr, "Could not allocate memory for fingerprint of file "
+      "\"%s\".\n", file_name);
+    return 1;
+  }
+  struct record record = {
+    .mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+    .size = st->st_size,
+    .fingerprint = fingerprint,
+    .content_id = get_record_field("CONTENT_ID"),
+    .title_id = get_record_field("TITLE_ID"),
+    .app_ver = get_record_field("APP_VER"),
+    .category = get_record_field("CATEGORY"),
+    .system_ver = system_ver,
+    .keys = get_record_keys(),
+    .path = file_name
+  };
+  int len = format_record(NULL, 0, &record);
+  char *line = arena_alloc(len + 1);
+  if (line == NULL) {
+    fprintf(stderr, "Could not allocate %d bytes of memory for record.\n",
+      len + 1);
+    return 1;
+  }
+  format_record(line, len + 1, &record);
+  // A single write() to a file opened with O_APPEND is never interleaved
+  if (write(results_fd, line, len) != len) {
+    fprintf(stderr, "Could not write record of file \"%s\".\n", file_name);
+    return 1;
+  }
+  return 0;
+}
+
+// Batch job that appends a file's record to results_fd
+int record_file(char *file_name) {
+  int fd = open_scan_file(file_name);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open file \"%s\".\n", file_name);
+    return 1;
+  }
+  struct stat st;
+  char *class, *error = "could not get file size";
+  if (fstat(fd, &st) || strcmp(class = check_fd(fd, &error), "ok")) {
+    fprintf(stderr, "Could not read file \"%s\": %s.\n", file_name, error);
+    close_scan_file(fd);
+    return 1;
+  }
+  close_scan_file(fd);
+  return write_record(file_name, &st);
+}
+
+// Records the metrics of process_file()'s loading of a file: bytes read, and
+// either the time it took or the error class of the step that failed; called
+// when the process exits, as loading errors end the process
+void record_load_metrics(void) {
+  metrics_add(&metrics[metrics_slot].bytes_read, load.bytes_read);
+  if (load.class == NULL) {
+    metrics_observe_ns(&metrics[metrics_slot].parse,
+      (load.end.tv_sec - load.start.tv_sec) * 1000000000ULL
+      + load.end.tv_nsec - load.start.tv_nsec);
+  } else if (file && feof(file)) {
+    metrics_error("truncated");
+  } else if (file && ferror(file)) {
+    metrics_error("io");
+  } else {
+    metrics_error(load.class);
+  }
+}
+
+// Runs process_file() in a child process, so that a damaged file cannot
+// terminate the calling process; returns the child's exit code
+int process_file_in_child(char *file_name) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  arena_init();
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "Could not create child process.\n");
+    exit(1);
+  } else if (pid == 0) {
+    if (metrics) {
+      atexit(record_load_metrics);
+    }
+    int exit_code = process_file(file_name, NULL);
+    // With a results file (option --watch with --cache), save the parse
+    struct stat st;
+    if (results_fd != -1 && !has_modifications()
+      && !fstat(fileno(file), &st)) {
+      write_record(file_name, &st);
+    }
+    exit(exit_code);
+  }
+
+  int status;
+  int failed = waitpid(pid, &status, 0) == -1 || !WIFEXITED(status);
+  if (metrics) {
+    metrics_observe(&metrics[metrics_slot].job, &start);
+    metrics_add(&metrics[metrics_slot].files, 1);
+  }
+  return failed ? 1 : WEXITSTATUS(status);
+}
+
+// Parses a record line (which it takes ownership of); returns 0 on success
+int parse_record(char *line, struct record *record) {
+  char *fields[RECORD_FIELDS];
+  char *p = line;
+  for (int i = 0; i < RECORD_FIELDS; i++) {
+    fields[i] = p;
+    p = strchr(p, i < RECORD_FIELDS - 1 ? '\t' : '\n');
+    if (p == NULL) {
+      if (i < RECORD_FIELDS - 1) return 1;
+    } else {
+      *p++ = '\0';
+    }
+  }
+  record->line = line;
+  record->mtime = strtoll(fields[0], NULL, 10);
+  record->size = strtoull(fields[1], NULL, 10);
+  record->fingerprint = strtoull(fields[2], NULL, 16);
+  record->content_id = fields[3];
+  record->title_id = fields[4];
+  record->app_ver = fields[5];
+  record->category = fields[6];
+  record->system_ver = fields[7];
+  record->keys = fields[8];
+  record->path = fields[9];
+  return 0;
+}
+
+// Appends all records of a file to a record array; returns 0 on success
+int read_records(FILE *file, struct record **records, int *records_count) {
+  char *line = NULL;
+  size_t size = 0;
+  while (getline(&line, &size, file) != -1) {
+    if (line[0] == '#') continue;
+    *records = _realloc(*records, sizeof(struct record) * (*records_count + 1));
+    if (parse_record(line, &(*records)[*records_count])) {
+      free(line);
+      return 1;
+    }
+    (*records_count)++;
+    line = NULL;
+    size = 0;
+  }
+  free(line);
+  return 0;
+}
+
+// Loads a cache file's records; a missing file is an empty cache
+void load_cache(char *file_name, struct record **records, int *records_count) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    return;
+  }
+  char header[sizeof(CACHE_HEADER)];
+  if (fgets(header, sizeof(header), file) == NULL
+    || strcmp(header, CACHE_HEADER)) {
+    fprintf(stderr, "Ignoring cache file \"%s\" of unknown format.\n",
+      file_name);
+  } else if (read_records(file, records, records_count)) {
+    fprintf(stderr, "Could not parse cache file \"%s\".\n", file_name);
+    exit(1);
+  }
+  fclose(file);
+}
+
+// Writes records to a cache file, replacing it atomically
+void save_cache(char *file_name, struct record *records, int records_count) {
+  if (snprintf(temp_file_name, sizeof(temp_file_name), "%s.XXXXXX",
+    file_name) >= sizeof(temp_file_name)) {
+    temp_file_name[0] = '\0'; // Not to be deleted by clean_exit()
+    fprintf(stderr, "File name \"%s\" is too long.\n", file_name);
+    exit(1);
+  }
+  int fd = mkstemp(temp_file_name);
+  FILE *file = fd == -1 ? NULL : fdopen(fd, "w");
+  if (file == NULL) {
+    temp_file_name[0] = '\0';
+    fprintf(stderr, "Could not open file \"%s\" in write mode.\n", file_name);
+    exit(1);
+  }
+  fputs(CACHE_HEADER, file);
+  char *line = NULL;
+  for (int i = 0; i < records_count; i++) {
+    int len = format_record(NULL, 0, &records[i]);
+    line = _realloc(line, len + 1);
+    format_record(line, len + 1, &records[i]);
+    fputs(line, file);
+  }
+  free(line);
+  if (fflush(file) || fsync(fd)) {
+    fprintf(stderr, "Could not write to file \"%s\".\n", file_name);
+    exit(1);
+  }
+  fclose(file);
+  if (rename(temp_file_name, file_name)) {
+    fprintf(stderr, "Could not replace file \"%s\".\n", file_name);
+    exit(1);
+  }
+  temp_file_name[0] = '\0';
+}
+
+// Frees a record array
+void free_records(struct record *records, int records_count) {
+  for (int i = 0; i < records_count; i++) {
+    free(records[i].line);
+  }
+  free(records);
+}
+
+// Compares two records by path, for qsort() and bsearch()
+int compare_records_by_path(const void *a, const void *b) {
+  return strcmp(((struct record *) a)->path, ((struct record *) b)->path);
+}
+
+// Compares two records by fingerprint, then by path
+int compare_records_by_fingerprint(const void *a, const void *b) {
+  const struct record *x = a, *y = b;
+  if (x->fingerprint != y->fingerprint) {
+    return x->fingerprint < y->fingerprint ? -1 : 1;
+  }
+  return strcmp(x->path, y->path);
+}
+
+// Compares two records by TITLE_ID, then by APP_VER, then by path
+int compare_records_by_title_id(const void *a, const void *b) {
+  const struct record *x = a, *y = b;
+  int result = strcmp(x->title_id, y->title_id);
+  if (result == 0) result = strcmp(x->app_ver, y->app_ver);
+  if (result == 0) result = strcmp(x->path, y->path);
+  return result;
+}
+
+// Compares two records by CATEGORY
+int compare_records_by_category(const void *a, const void *b) {
+  return strcmp(((struct record *) a)->category,
+    ((struct record *) b)->category);
+}
+
+// Compares two records by SYSTEM_VER
+int compare_records_by_system_ver(const void *a, const void *b) {
+  return strcmp(((struct record *) a)->system_ver,
+    ((struct record *) b)->system_ver);
+}
+
+// Compares two records by CONTENT_ID, then by APP_VER, then by path
+int compare_records_by_version(const void *a, const void *b) {
+  const struct record *x = a, *y = b;
+  int result = strcmp(x->content_id, y->content_id);
+  if (result == 0) result = strcmp(x->app_ver, y->app_ver);
+  if (result == 0) result = strcmp(x->path, y->path);
+  return result;
+}
+
+// Gets the records of all cache segments given as input files (written by
+// runs with options --shard and --cache), and saves them to the cache file if
+// one is specified; returns the number of segments that could not be read
+int merge_segments(struct record **records, int *records_count) {
+  int failed = 0;
+  for (int i = 0; i < input_files_count; i++) {
+    FILE *file = fopen(input_files[i], "r");
+    if (file == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", input_files[i]);
+      failed++;
+      continue;
+    }
+    char header[sizeof(CACHE_HEADER)];
+    if (fgets(header, sizeof(header), file) == NULL
+      || strcmp(header, CACHE_HEADER)) {
+      fprintf(stderr, "File \"%s\" is not a cache file.\n", input_files[i]);
+      failed++;
+    } else if (read_records(file, records, records_count)) {
+      fprintf(stderr, "Could not parse cache file \"%s\".\n", input_files[i]);
+      failed++;
+    }
+    fclose(file);
+  }
+
+  // A file can only be in multiple segments if shards overlapped; keep the
+  // first record
+  qsort(*records, *records_count, sizeof(struct record),
+    compare_records_by_path);
+  int count = 0;
+  for (int i = 0; i < *records_count; i++) {
+    if (count && !compare_records_by_path(&(*records)[count - 1],
+      &(*records)[i])) {
+      free((*records)[i].line);
+    } else {
+      (*records)[count++] = (*records)[i];
+    }
+  }
+  *records_count = count;
+
+  if (cache_file_name) {
+    save_cache(cache_file_name, *records, *records_count);
+  }
+  return failed;
+}
+
+// Gets the records of all input files, reading only files that are not in
+// the scan cache (or have changed since), and updates the cache; returns the
+// number of files that could not be read
+int get_records(struct record **records, int *records_count) {
+  if (option_merge) {
+    return merge_segments(records, records_count);
+  }
+
+  struct record *cache = NULL;
+  int cache_count = 0;
+  if (cache_file_name) {
+    load_cache(cache_file_name, &cache, &cache_count);
+    qsort(cache, cache_count, sizeof(struct record), compare_records_by_path);
+  }
+
+  // Take unchanged files' records from the cache
+  char **scan_files = _realloc(NULL, sizeof(char *) * input_files_count);
+  int scan_files_count = 0;
+  int failed = 0;
+  for (int i = 0; i < input_files_count; i++) {
+    struct stat st;
+    if (stat(input_files[i], &st)) {
+      fprintf(stderr, "Could not open file \"%s\".\n", input_files[i]);
+      failed++;
+      continue;
+    }
+    struct record key = {.path = input_files[i]};
+    struct record *cached = cache_count ? bsearch(&key, cache, cache_count,
+      sizeof(struct record), compare_records_by_path) : NULL;
+    if (cached && cached->size == st.st_size && cached->mtime ==
+      (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec) {
+      *records = _realloc(*records,
+        sizeof(struct record) * (*records_count + 1));
+      (*records)[(*records_count)++] = *cached;
+      cached->line = NULL; // Now owned by *records
+      if (stats) stats->cache_hits++;
+      if (metrics) metrics_add(&metrics[metrics_slot].cache_hits, 1);
+    } else {
+      scan_files[scan_files_count++] = input_files[i];
+      if (stats && cache_file_name) stats->cache_misses++;
+      if (metrics && cache_file_name) {
+        metrics_add(&metrics[metrics_slot].cache_misses, 1);
+      }
+    }
+  }
+
+  // Read all other files in parallel
+  FILE *results = tmpfile();
+  if (results == NULL) {
+    fprintf(stderr, "Could not create temporary file.\n");
+    exit(1);
+  }
+  results_fd = fileno(results);
+  fcntl(results_fd, F_SETFL, fcntl(results_fd, F_GETFL) | O_APPEND);
+  int *exit_codes = _realloc(NULL, sizeof(int) * (scan_files_count + 1));
+  run_jobs(record_file, scan_files, scan_files_count, exit_codes);
+  for (int i = 0; i < scan_files_count; i++) {
+    if (exit_codes[i]) failed++;
+  }
+  free(exit_codes);
+  free(scan_files);
+  rewind(results);
+  if (read_records(results, records, records_count)) {
+    fprintf(stderr, "Could not parse batch job results.\n");
+    exit(1);
+  }
+  fclose(results);
+  results_fd = -1;
+
+  // Keep records of files not processed this time, then save the cache
+  if (cache_file_name) {
+    qsort(*records, *records_count, sizeof(struct record),
+      compare_records_by_path);
+    struct record *all = _realloc(NULL,
+      sizeof(struct record) * (*records_count + cache_count + 1));
+    memcpy(all, *records, sizeof(struct record) * *records_count);
+    int all_count = *records_count;
+    for (int i = 0; i < cache_count; i++) {
+      if (cache[i].line && !bsearch(&cache[i], *records, *records_count,
+        sizeof(struct record), compare_records_by_path)) {
+        all[all_count++] = cache[i];
+      }
+    }
+    qsort(all, all_count, sizeof(struct record), compare_records_by_path);
+    save_cache(cache_file_name, all, all_count);
+    free(all);
+    for (int i = 0; i < cache_count; i++) {
+      free(cache[i].line);
+    }
+    free(cache);
+  }
+
+  return failed;
+}
+
+// Directories watched by option --watch, indexed by watch descriptor
+int watch_fd;
+char **watch_paths;
+int watch_paths_count;
+
+// With option --cache, the cache's records, sorted by path. They are kept in
+// memory, updated from the parses that print the files, and written to the
+// cache file at most every WATCH_CACHE_INTERVAL seconds.
+#define WATCH_CACHE_INTERVAL 5
+struct record *watch_cache;
+int watch_cache_count;
+int watch_cache_changed;
+struct timespec watch_cache_saved;
+FILE *watch_results; // Records written by the child processes of events
+
+// Returns whether a path is the same as or inside another path
+int is_below(char *path, char *dir_name) {
+  size_t len = strlen(dir_name);
+  return !strncmp(path, dir_name, len) && (path[len] == '\0'
+    || path[len] == '/');
+}
+
+// Adds an inotify watch for a directory; returns the watch descriptor or -1
+int add_watch(char *dir_name) {
+  // Files are parsed when closed after writing, not when created (at which
+  // point they are usually still empty); only created directories matter
+  int wd = inotify_add_watch(watch_fd, dir_name, IN_CREATE | IN_CLOSE_WRITE |
+    IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF |
+    IN_ONLYDIR | IN_DONT_FOLLOW);
+  if (wd == -1) {
+    return -1;
+  }
+  if (wd >= watch_paths_count) {
+    watch_paths = _realloc(watch_paths, sizeof(char *) * (wd + 1));
+    memset(&watch_paths[watch_paths_count], 0,
+      sizeof(char *) * (wd + 1 - watch_paths_count));
+    watch_paths_count = wd + 1;
+  }
+  free(watch_paths[wd]);
+  if ((watch_paths[wd] = strdup(dir_name)) == NULL) {
+    fprintf(stderr, "Could not allocate memory for path \"%s\".\n", dir_name);
+    exit(1);
+  }
+  return wd;
+}
+
+// Removes the watches of a directory and all directories below it (e.g.
+// after it was moved elsewhere, where its files' paths are unknown)
+void remove_watches(char *dir_name) {
+  for (int i = 0; i < watch_paths_count; i++) {
+    if (watch_paths[i] && is_below(watch_paths[i], dir_name)) {
+      inotify_rm_watch(watch_fd, i);
+      free(watch_paths[i]);
+      watch_paths[i] = NULL;
+    }
+  }
+}
+
+// Returns the index of the first cached record whose path is not less than a
+// path
+int find_cached_record(char *path) {
+  int low = 0, high = watch_cache_count;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (strcmp(watch_cache[middle].path, path) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Drops the cached records from index first to last (exclusive)
+void drop_cached_records(int first, int last) {
+  if (first == last) {
+    return;
+  }
+  for (int i = first; i < last; i++) {
+    free(watch_cache[i].line);
+  }
+  memmove(&watch_cache[first], &watch_cache[last],
+    sizeof(struct record) * (watch_cache_count - last));
+  watch_cache_count -= last - first;
+  watch_cache_changed = 1;
+}
+
+// Drops the cached records of a path and of all paths below it
+void remove_cached_records(char *path) {
+  int index = find_cached_record(path);
+  if (index < watch_cache_count && !strcmp(watch_cache[index].path, path)) {
+    drop_cached_records(index, index + 1);
+  }
+
+  // Paths below it are adjacent, as they all start with "PATH/"
+  char prefix[PATH_MAX + 1];
+  size_t len = snprintf(prefix, sizeof(prefix), "%s/", path);
+  int first = find_cached_record(prefix), last = first;
+  while (last < watch_cache_count
+    && !strncmp(watch_cache[last].path, prefix, len)) {
+    last++;
+  }
+  drop_cached_records(first, last);
+}
+
+// Moves the records written by the child processes of events into the cache,
+// replacing older records of the same files
+void read_watch_results(void) {
+  struct record *records = NULL;
+  int records_count = 0;
+  rewind(watch_results);
+  if (read_records(watch_results, &records, &records_count)
+    || ftruncate(fileno(watch_results), 0)) {
+    fprintf(stderr, "Could not read the records of watch events.\n");
+    exit(1);
+  }
+  if (records_count == 0) {
+    return;
+  }
+
+  // Of multiple records of a file, keep the newest one
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_path);
+  int count = 0;
+  for (int i = 0; i < records_count; i++) {
+    if (count && !compare_records_by_path(&records[count - 1], &records[i])) {
+      if (records[i].mtime >= records[count - 1].mtime) {
+        free(records[count - 1].line);
+        records[count - 1] = records[i];
+      } else {
+        free(records[i].line);
+      }
+    } else {
+      records[count++] = records[i];
+    }
+  }
+
+  // Replace records in place, then merge the records of new files
+  int new_count = 0;
+  for (int i = 0; i < count; i++) {
+    int index = find_cached_record(records[i].path);
+    if (index < watch_cache_count
+      && !strcmp(watch_cache[index].path, records[i].path)) {
+      free(watch_cache[index].line);
+      watch_cache[index] = records[i];
+    } else {
+      records[new_count++] = records[i];
+    }
+  }
+  if (new_count) {
+    struct record *merged = _realloc(NULL,
+      sizeof(struct record) * (watch_cache_count + new_count));
+    int i = 0, j = 0, k = 0;
+    while (i < watch_cache_count || j < new_count) {
+      if (j == new_count || (i < watch_cache_count
+        && compare_records_by_path(&watch_cache[i], &records[j]) < 0)) {
+        merged[k++] = watch_cache[i++];
+      } else {
+        merged[k++] = records[j++];
+      }
+    }
+    free(watch_cache);
+    watch_cache = merged;
+    watch_cache_count = k;
+  }
+  free(records);
+  watch_cache_changed = 1;
+}
+
+// Writes the cached records to the cache file
+void save_watch_cache(void) {
+  save_cache(cache_file_name, watch_cache, watch_cache_count);
+  watch_cache_changed = 0;
+  clock_gettime(CLOCK_MONOTONIC, &watch_cache_saved);
+}
+
+// Prints a watch event line "EVENT: PATH", followed by the file's parameters
+// if the file is (still) inside the watched directory; with option --cache,
+// drops the records of paths that are gone
+void print_watch_event(char *event, char *path, int print_file) {
+  printf("%s: %s\n", event, path);
+  if (print_file) {
+    process_file_in_child(path);
+  } else if (cache_file_name) {
+    // Records of earlier events may still be waiting
+    read_watch_results();
+    remove_cached_records(path);
+  }
+  printf("\n");
+}
+
+// Prints the parameters of all regular files inside an already watched
+// directory, and watches and scans its subdirectories
+void scan_dir(char *dir_name, char *event) {
+  struct dirent **names;
+  int names_count = scandir(dir_name, &names, NULL, alphasort);
+  if (names_count == -1) {
+    fprintf(stderr, "Could not open directory \"%s\".\n", dir_name);
+    return;
+  }
+
+  for (int i = 0; i < names_count; i++) {
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir_name, names[i]->d_name);
+    if (!strcmp(names[i]->d_name, ".") || !strcmp(names[i]->d_name, "..")) {
+      // Not part of the tree
+    } else if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      // Watch before scanning, so that no new file can be missed
+      if (add_watch(path) == -1) {
+        fprintf(stderr, "Could not watch directory \"%s\".\n", path);
+      } else {
+        scan_dir(path, event);
+      }
+    } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      print_watch_event(event, path, 1);
+    }
+    free(names[i]);
+  }
+  free(names);
+}
+
+// Scans a directory tree once, then only prints files that are written to,
+// moved in, moved out, or deleted; with option --cache, keeps the cache's
+// records of the tree's files up to date
+void watch(char *dir_name) {
+  watch_fd = inotify_init1(IN_CLOEXEC);
+  if (watch_fd == -1) {
+    fprintf(stderr, "Could not initialize inotify.\n");
+    exit(1);
+  }
+  int root = add_watch(dir_name);
+  if (root == -1) {
+    fprintf(stderr, "Could not watch directory \"%s\".\n", dir_name);
+    exit(1);
+  }
+  if (cache_file_name) {
+    load_cache(cache_file_name, &watch_cache, &watch_cache_count);
+    if (watch_cache_count) {
+      qsort(watch_cache, watch_cache_count, sizeof(struct record),
+        compare_records_by_path);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &watch_cache_saved);
+    if ((watch_results = tmpfile()) == NULL) {
+      fprintf(stderr, "Could not create temporary file.\n");
+      exit(1);
+    }
+    results_fd = fileno(watch_results);
+    fcntl(results_fd, F_SETFL, fcntl(results_fd, F_GETFL) | O_APPEND);
+  }
+
+  // Scan after adding the watch, so that no new file can be missed
+  scan_dir(dir_name, "found");
+
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    int timeout = -1; // Milliseconds to wait for events
+    if (cache_file_name) {
+      read_watch_results();
+      if (watch_cache_changed) {
+        uint64_t elapsed = nanoseconds_since(&watch_cache_saved) / 1000000;
+        if (elapsed >= WATCH_CACHE_INTERVAL * 1000) {
+          save_watch_cache();
+        } else {
+          timeout = WATCH_CACHE_INTERVAL * 1000 - elapsed;
+        }
+      }
+    }
+    fflush(stdout);
+    if (metrics) {
+      if (nanoseconds_since(&metrics_written) >= METRICS_INTERVAL
+        * 1000000000ULL) {
+        write_metrics();
+      }
+      if (timeout == -1 || timeout > METRICS_INTERVAL * 1000) {
+        timeout = METRICS_INTERVAL * 1000;
+      }
+    }
+    if (timeout != -1) {
+      struct pollfd pollfd = {.fd = watch_fd, .events = POLLIN};
+      if (poll(&pollfd, 1, timeout) <= 0) {
+        continue;
+      }
+    }
+    ssize_t len = read(watch_fd, buf, sizeof(buf));
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Could not read inotify events.\n");
+      exit(1);
+    }
+
+    struct inotify_event *event;
+    for (char *p = buf; p < buf + len;
+      p += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *) p;
+      if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Events were lost; rescanning directory \"%s\".\n",
+          dir_name);
+        scan_dir(dir_name, "found");
+        continue;
+      }
+      if (event->wd == root && event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        fprintf(stderr, "Directory \"%s\" has been removed.\n", dir_name);
+        exit(1);
+      }
+      if (event->wd >= watch_paths_count || watch_paths[event->wd] == NULL) {
+        continue; // Removed watch
+      }
+      if (event->mask & IN_IGNORED) {
+        free(watch_paths[event->wd]);
+        watch_paths[event->wd] = NULL;
+        continue;
+      }
+      if (event->len == 0) {
+        continue;
+      }
+
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", watch_paths[event->wd],
+        event->name);
+      if (event->mask & IN_ISDIR) {
+        // Files inside new directories are printed like those found by the
+        // initial scan; a directory moved out takes its files with it (a
+        // deleted directory's files have been reported as deleted already)
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          if (add_watch(path) == -1) {
+            fprintf(stderr, "Could not watch directory \"%s\".\n", path);
+          } else {
+            scan_dir(path, event->mask & IN_CREATE ? "found" : "moved_in");
+          }
+        } else if (event->mask & IN_MOVED_FROM) {
+          remove_watches(path);
+          print_watch_event("moved_out", path, 0);
+        }
+      } else if (event->mask & IN_CLOSE_WRITE) {
+        print_watch_event("written", path, 1);
+      } else if (event->mask & IN_MOVED_TO) {
+        print_watch_event("moved_in", path, 1);
+      } else if (event->mask & IN_MOVED_FROM) {
+        print_watch_event("moved_out", path, 0);
+      } else if (event->mask & IN_DELETE) {
+        print_watch_event("deleted", path, 0);
+      }
+    }
+  }
+}
+
+// Prints groups of files with identical parameters, and groups of files that
+// share a CONTENT_ID but differ in APP_VER; returns the exit code
+int find_duplicates(void) {
+  struct record *records = NULL;
+  int records_count = 0;
+  int failed = get_records(&records, &records_count);
+  if (shard_count) { // Results are complete only after option --merge
+    free_records(records, records_count);
+    return failed ? 1 : 0;
+  }
+
+  // Lines "duplicate FINGERPRINT FILE", one group after another
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_fingerprint);
+  for (int i = 0; i < records_count;) {
+    int j = i + 1;
+    while (j < records_count && records[j].fingerprint == records[i].fingerprint) {
+      j++;
+    }
+    for (int k = i; j - i > 1 && k < j; k++) {
+      printf("duplicate\t%016llx\t%s\n",
+        (unsigned long long) records[k].fingerprint, records[k].path);
+    }
+    i = j;
+  }
+
+  // Lines "outdated|newest CONTENT_ID APP_VER FILE", sorted by APP_VER
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_version);
+  for (int i = 0; i < records_count;) {
+    int j = i + 1;
+    while (j < records_count && records[i].content_id[0]
+      && !strcmp(records[j].content_id, records[i].content_id)) {
+      j++;
+    }
+    if (strcmp(records[i].app_ver, records[j - 1].app_ver)) {
+      for (int k = i; k < j; k++) {
+        printf("%s\t%s\t%s\t%s\n",
+          strcmp(records[k].app_ver, records[j - 1].app_ver) ? "outdated"
+          : "newest", records[k].content_id, records[k].app_ver,
+          records[k].path);
+      }
+    }
+    i = j;
+  }
+
+  free_records(records, records_count);
+  return failed ? 1 : 0;
+}
+
+// Prints a string as a JSON string literal
+void print_json_string(char *string) {
+  putchar('"');
+  for (unsigned char *c = (unsigned char *) string; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if (*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+// Prints a report section's line (table) or object member (JSON) for a value
+// shared by count files; section is NULL for JSON members nested in a group
+void print_report_count(char *section, char *group, char *value, int count,
+  int first) {
+  if (strcmp(stats_report_format, "json")) {
+    if (group) {
+      printf("%s\t%s\t%s\t%d\n", section, group, value, count);
+    } else {
+      printf("%s\t%s\t%d\n", section, value, count);
+    }
+  } else {
+    printf(first ? "" : ", ");
+    print_json_string(value);
+    printf(": %d", count);
+  }
+}
+
+// Prints the beginning of a JSON report section
+void print_report_section(char *name, int first) {
+  if (!strcmp(stats_report_format, "json")) {
+    printf("%s\n  \"%s\": {", first ? "" : ",", name);
+  }
+}
+
+// Prints the end of a JSON report section
+void print_report_section_end(void) {
+  if (!strcmp(stats_report_format, "json")) {
+    printf("}");
+  }
+}
+
+// Compares two strings through pointers, for qsort()
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+// Prints aggregate statistics of all input files: counts per CATEGORY, APP_VER
+// per TITLE_ID, SYSTEM_VER (by firmware version), and key; returns the exit
+// code
+int print_stats_report(void) {
+  struct record *records = NULL;
+  int records_count = 0;
+  int failed = get_records(&records, &records_count);
+  if (shard_count) { // Results are complete only after option --merge
+    free_records(records, records_count);
+    return failed ? 1 : 0;
+  }
+  int json = !strcmp(stats_report_format, "json");
+
+  if (json) {
+    printf("{\n  \"files\": %d,\n  \"failed\": %d,", records_count, failed);
+  } else {
+    printf("files\t%d\nfailed\t%d\n", records_count, failed);
+  }
+
+  // Files per CATEGORY
+  print_report_section("category", 1);
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_category);
+  for (int i = 0; i < records_count;) {
+    int j = i + 1;
+    while (j < records_count
+      && !strcmp(records[j].category, records[i].category)) {
+      j++;
+    }
+    print_report_count("category", NULL, records[i].category, j - i, i == 0);
+    i = j;
+  }
+  print_report_section_end();
+
+  // Files per APP_VER, grouped by TITLE_ID
+  print_report_section("app_ver", 0);
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_title_id);
+  for (int i = 0; i < records_count;) {
+    int j = i + 1;
+    while (j < records_count
+      && !strcmp(records[j].title_id, records[i].title_id)) {
+      j++;
+    }
+    if (json) {
+      printf(i == 0 ? "\n    " : ",\n    ");
+      print_json_string(records[i].title_id);
+      printf(": {");
+    }
+    for (int k = i; k < j;) {
+      int l = k + 1;
+      while (l < j && !strcmp(records[l].app_ver, records[k].app_ver)) {
+        l++;
+      }
+      print_report_count("app_ver", records[i].title_id, records[k].app_ver,
+        l - k, k == i);
+      k = l;
+    }
+    if (json) printf("}");
+    i = j;
+  }
+  if (json && records_count) printf("\n  ");
+  print_report_section_end();
+
+  // Files per required firmware version (SYSTEM_VER's upper 16 bits)
+  print_report_section("system_ver", 0);
+  qsort(records, records_count, sizeof(struct record),
+    compare_records_by_system_ver);
+  for (int i = 0; i < records_count;) {
+    int j = i + 1;
+    while (j < records_count
+      && !strncmp(records[j].system_ver, records[i].system_ver, 4)) {
+      j++;
+    }
+    char firmware[8] = "";
+    if (records[i].system_ver[0]) {
+      unsigned int system_ver = strtoul(records[i].system_ver, NULL, 16);
+      snprintf(firmware, sizeof(firmware), "%x.%02x", system_ver >> 24,
+        system_ver >> 16 & 0xff);
+    }
+    print_report_count("system_ver", NULL, firmware, j - i, i == 0);
+    i = j;
+  }
+  print_report_section_end();
+
+  // Files per key
+  print_report_section("key", 0);
+  char **keys = NULL;
+  int keys_count = 0;
+  for (int i = 0; i < records_count; i++) {
+    for (char *key = strtok(records[i].keys, ","); key;
+      key = strtok(NULL, ",")) {
+      keys = _realloc(keys, sizeof(char *) * (keys_count + 1));
+      keys[keys_count++] = key;
+    }
+  }
+  qsort(keys, keys_count, sizeof(char *), compare_strings);
+  for (int i = 0; i < keys_count;) {
+    int j = i + 1;
+    while (j < keys_count && !strcmp(keys[j], keys[i])) {
+      j++;
+    }
+    print_report_count("key", NULL, keys[i], j - i, i == 0);
+    i = j;
+  }
+  print_report_section_end();
+  if (json) printf("\n}\n");
+
+  free(keys);
+  free_records(records, records_count);
+  return failed ? 1 : 0;
+}
+
+// Loaded param.sfo, for modes that need several files in memory at once
+struct sfo {
+  struct header header;
+  struct index_table_entry *entries;
+  struct table key_table;
+  struct table data_table;
+};
+
+// Files for option --diff, in groups that are each diffed by one batch job
+struct diff_group {
+  char **files;
+  int files_count;
+} *diff_groups;
+
+// Loads a file's param.sfo into arena memory, with its index table sorted by
+// key; returns 0 on success
+int load_sfo(char *file_name, struct sfo *sfo) {
+  int fd = open_scan_file(file_name);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open file \"%s\".\n", file_name);
+    return 1;
+  }
+  char *error;
+  if (strcmp(check_fd(fd, &error), "ok")) {
+    fprintf(stderr, "Could not read file \"%s\": %s.\n", file_name, error);
+    close_scan_file(fd);
+    return 1;
+  }
+  close_scan_file(fd);
+
+  // Index tables are sorted by key already, unless a file is non-standard
+  for (int i = 1; i < header.entries_count; i++) {
+    if (compare_entries(&entries[i - 1], &entries[i]) > 0) {
+      qsort(entries, header.entries_count, sizeof(struct index_table_entry),
+        compare_entries);
+      break;
+    }
+  }
+
+  sfo->header = header;
+  sfo->entries = entries;
+  sfo->key_table = key_table;
+  sfo->data_table = data_table;
+  return 0;
+}
+
+// Returns a parameter format's name, as printed by option --diff
+char *get_format_name(uint16_t param_fmt) {
+  switch (param_fmt) {
+    case 516: return "str";
+    case 1024: return "special_str";
+    case 1028: return "int";
+    default: return "unknown";
+  }
+}
+
+// Prints a tab character and a parameter's value
+void print_diff_value(struct sfo *sfo, struct index_table_entry *entry) {
+  char *data = &sfo->data_table.content[entry->data_offset];
+  if (entry->param_fmt == 1028) {
+    uint32_t integer;
+    memcpy(&integer, data, 4);
+    printf(option_decimal ? "\t%u" : "\t0x%08x", integer);
+  } else {
+    printf("\t%s", data);
+  }
+}
+
+// Prints the differences between two param.sfo files in a single pass over
+// their sorted index tables
+void diff_sfos(char *name_a, struct sfo *a, char *name_b, struct sfo *b) {
+  printf("diff\t%s\t%s\n", name_a, name_b);
+  int i = 0, j = 0;
+  while (i < a->header.entries_count || j < b->header.entries_count) {
+    struct index_table_entry *x = &a->entries[i], *y = &b->entries[j];
+    int result;
+    if (i == a->header.entries_count) {
+      result = 1;
+    } else if (j == b->header.entries_count) {
+      result = -1;
+    } else {
+      result = strcmp(&a->key_table.content[x->key_offset],
+        &b->key_table.content[y->key_offset]);
+    }
+
+    if (result < 0) {
+      printf("removed\t%s", &a->key_table.content[x->key_offset]);
+      print_diff_value(a, x);
+      printf("\n");
+      i++;
+    } else if (result > 0) {
+      printf("added\t%s", &b->key_table.content[y->key_offset]);
+      print_diff_value(b, y);
+      printf("\n");
+      j++;
+    } else {
+      char *key = &a->key_table.content[x->key_offset];
+      char *data_a = &a->data_table.content[x->data_offset];
+      char *data_b = &b->data_table.content[y->data_offset];
+      if (x->param_fmt != y->param_fmt) {
+        printf("type\t%s\t%s\t%s\n", key, get_format_name(x->param_fmt),
+          get_format_name(y->param_fmt));
+      }
+      if (x->param_fmt != y->param_fmt || (x->param_fmt == 1028
+        ? memcmp(data_a, data_b, 4) : strcmp(data_a, data_b))) {
+        printf("changed\t%s", key);
+        print_diff_value(a, x);
+        print_diff_value(b, y);
+        printf("\n");
+      }
+      if (x->param_max_len != y->param_max_len) {
+        printf("max_len\t%s\t%u\t%u\n", key, x->param_max_len,
+          y->param_max_len);
+      }
+      i++;
+      j++;
+    }
+  }
+}
+
+// Batch job that diffs each file of a group (file_name being the first one)
+// with the group's next file, loading every file only once
+int diff_group(char *file_name) {
+  struct diff_group *group = &diff_groups[job_index];
+  struct sfo previous, current;
+  if (load_sfo(file_name, &previous)) {
+    return 1;
+  }
+  for (int i = 1; i < group->files_count; i++) {
+    if (load_sfo(group->files[i], &current)) {
+      return 1;
+    }
+    diff_sfos(group->files[i - 1], &previous, group->files[i], &current);
+    previous = current;
+  }
+  return 0;
+}
+
+// Diffs 2 files, or groups files by TITLE_ID and diffs them in order of
+// APP_VER, each group in parallel; returns the exit code
+int diff_files(void) {
+  struct record *records = NULL;
+  int records_count = 0;
+  int failed = 0;
+  int groups_count = 0;
+
+  if (input_files_count == 2 && !option_merge && !shard_count) {
+    diff_groups = _realloc(NULL, sizeof(struct diff_group));
+    diff_groups[0].files = input_files;
+    diff_groups[0].files_count = 2;
+    groups_count = 1;
+  } else {
+    failed = get_records(&records, &records_count);
+    if (shard_count && !option_merge) { // Records are merged first
+      free_records(records, records_count);
+      return failed ? 1 : 0;
+    }
+    qsort(records, records_count, sizeof(struct record),
+      compare_records_by_title_id);
+    for (int i = 0; i < records_count;) {
+      int j = i + 1;
+      while (j < records_count && records[i].title_id[0]
+        && !strcmp(records[j].title_id, records[i].title_id)) {
+        j++;
+      }
+      if (j - i > 1) {
+        diff_groups = _realloc(diff_groups,
+          sizeof(struct diff_group) * (groups_count + 1));
+        diff_groups[groups_count].files = _realloc(NULL, sizeof(char *) * (j - i));
+        diff_groups[groups_count].files_count = j - i;
+        for (int k = i; k < j; k++) {
+          diff_groups[groups_count].files[k - i] = records[k].path;
+        }
+        groups_count++;
+      }
+      i = j;
+    }
+  }
+
+  // With options --merge and --shard, diff only the K-th of N consecutive
+  // parts of the groups, which all machines sort the same way, so that the
+  // parts' outputs concatenated in order equal a single run's output
+  if (shard_count && option_merge) {
+    int first = (int64_t) groups_count * shard_index / shard_count;
+    int last = (int64_t) groups_count * (shard_index + 1) / shard_count;
+    for (int i = 0; i < groups_count; i++) {
+      if (i < first || i >= last) free(diff_groups[i].files);
+    }
+    if (first < last) {
+      memmove(diff_groups, &diff_groups[first],
+        sizeof(struct diff_group) * (last - first));
+    }
+    groups_count = last - first;
+  }
+
+  char **first_files = _realloc(NULL, sizeof(char *) * (groups_count + 1));
+  int *exit_codes = _realloc(NULL, sizeof(int) * (groups_count + 1));
+  for (int i = 0; i < groups_count; i++) {
+    first_files[i] = diff_groups[i].files[0];
+  }
+  ordered_output = 1;
+  run_jobs(diff_group, first_files, groups_count, exit_codes);
+  ordered_output = 0;
+  for (int i = 0; i < groups_count; i++) {
+    if (exit_codes[i]) failed++;
+    if (records) free(diff_groups[i].files);
+  }
+
+  free(exit_codes);
+  free(first_files);
+  free(diff_groups);
+  free_records(records, records_count);
+  return failed ? 1 : 0;
+}
+
+// A batch job's error messages, captured so they can be printed with the
+// job's file name
+FILE *captured_errors;
+int stderr_fd = -1;
+char *captured_file_name;
+
+// Prints a batch job's captured error messages, each prefixed with the job's
+// file name; runs when the job's process exits
+void print_captured_errors(void) {
+  fflush(stderr);
+  dup2(stderr_fd, STDERR_FILENO);
+  rewind(captured_errors);
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, captured_errors)) != -1) {
+    fprintf(stderr, "%s: %s%s", captured_file_name, line,
+      line[len - 1] == '\n' ? "" : "\n");
+  }
+  free(line);
+}
+
+// Batch job that modifies a single file; returns 0 on success, 1 on failure,
+// or 2 if the file was written but modifications were skipped due to option
+// --force. Error messages are prefixed with the file name.
+int modify_file(char *file_name) {
+  captured_errors = tmpfile();
+  if (captured_errors && (stderr_fd = dup(STDERR_FILENO)) != -1
+    && dup2(fileno(captured_errors), STDERR_FILENO) != -1) {
+    captured_file_name = file_name;
+    atexit(print_captured_errors);
+  }
+  int exit_code = process_file(file_name, NULL);
+  if (exit_code == 0 && skipped_modifications) {
+    return 2;
+  }
+  return exit_code;
+}
+
+// Applies all modifications to all input files in parallel, printing a
+// report line for each file and a summary; returns the exit code
+int modify_files(void) {
+  int *exit_codes = _realloc(NULL, sizeof(int) * input_files_count);
+  run_jobs(modify_file, input_files, input_files_count, exit_codes);
+
+  int succeeded = 0, partial = 0, failed = 0;
+  for (int i = 0; i < input_files_count; i++) {
+    switch (exit_codes[i]) {
+      case 0:
+        printf("succeeded: %s\n", input_files[i]);
+        succeeded++;
+        break;
+      case 2:
+        printf("partial: %s\n", input_files[i]);
+        partial++;
+        break;
+      default:
+        printf("failed: %s\n", input_files[i]);
+        failed++;
+    }
+  }
+  printf("%d succeeded, %d partial, %d failed\n", succeeded, partial, failed);
+
+  free(exit_codes);
+  return failed ? 1 : 0;
+}
+
+// A parameter of a file described by option --build-from's SPEC_FILE
+struct spec_param {
+  char *line; // Owns the strings below
+  char *file_name;
+  char *type;
+  char *key;
+  char *value;
+};
+
+// The parameters of a file to be built, sorted by key
+struct spec_file {
+  char *name;
+  struct spec_param *params;
+  int params_count;
+} *spec_files;
+
+// Compares two spec parameters by file name, then by key
+int compare_spec_params(const void *a, const void *b) {
+  const struct spec_param *x = a, *y = b;
+  int result = strcmp(x->file_name, y->file_name);
+  if (result == 0) result = strcmp(x->key, y->key);
+  return result;
+}
+
+// Reads SPEC_FILE lines "OUTPUT_FILE TYPE PARAMETER VALUE", separated by tabs,
+// and returns the parameters sorted by file name and key; exits on errors
+struct spec_param *read_spec(char *spec_file_name, int *params_count) {
+  FILE *file = strcmp(spec_file_name, "-") ? fopen(spec_file_name, "r")
+    : stdin;
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", spec_file_name);
+    exit(1);
+  }
+
+  struct spec_param *params = NULL;
+  *params_count = 0;
+  char *line = NULL;
+  size_t size = 0;
+  for (int line_number = 1; getline(&line, &size, file) != -1;
+    line_number++) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '#' || line[0] == '\0') continue;
+    struct spec_param param = {.line = line};
+    char *fields[4], *p = line;
+    int fields_count = 0;
+    while (fields_count < 4 && p) {
+      fields[fields_count++] = p;
+      p = fields_count < 4 ? strchr(p, '\t') : NULL;
+      if (p) *p++ = '\0';
+    }
+    if (fields_count < 4 || fields[0][0] == '\0' || (strcmp(fields[1], "str")
+      && strcmp(fields[1], "int"))) {
+      fprintf(stderr, "Invalid line %d in file \"%s\".\n", line_number,
+        spec_file_name);
+      exit(1);
+    }
+    param.file_name = fields[0];
+    param.type = fields[1];
+    param.key = fields[2];
+    param.value = fields[3];
+    if (!strcmp(param.type, "str") && !is_valid_utf8((unsigned char *)
+      param.value, strlen(param.value))) {
+      fprintf(stderr, "Value on line %d in file \"%s\" is not valid UTF-8.\n",
+        line_number, spec_file_name);
+      exit(1);
+    }
+    toupper_string(param.key);
+    params = _realloc(params, sizeof(struct spec_param) * (*params_count + 1));
+    params[(*params_count)++] = param;
+    line = NULL;
+    size = 0;
+  }
+  free(line);
+  if (file != stdin) fclose(file);
+
+  qsort(params, *params_count, sizeof(struct spec_param),
+    compare_spec_params);
+  for (int i = 1; i < *params_count; i++) {
+    if (!compare_spec_params(&params[i - 1], &params[i])) {
+      fprintf(stderr, "Parameter \"%s\" of file \"%s\" is specified more "
+        "than once.\n", params[i].key, params[i].file_name);
+      exit(1);
+    }
+  }
+  return params;
+}
+
+// Lays out a new param.sfo in memory from parameters sorted by key, computing
+// all offsets in one pass; returns 0 on success
+int build_param_sfo(struct spec_param *params, int params_count) {
+  header.magic = 1179865088;
+  header.version = 257;
+  header.entries_count = params_count;
+  entries = arena_alloc(sizeof(struct index_table_entry) * params_count);
+  if (params_count && entries == NULL) {
+    fprintf(stderr, "Could not allocate memory for file \"%s\".\n",
+      params[0].file_name);
+    return 1;
+  }
+
+  key_table.size = 0;
+  data_table.size = 0;
+  for (int i = 0; i < params_count; i++) {
+    struct index_table_entry *entry = &entries[i];
+    entry->key_offset = key_table.size;
+    entry->data_offset = data_table.size;
+    if (!strcmp(params[i].type, "str")) {
+      entry->param_fmt = 516;
+      entry->param_len = strlen(params[i].value) + 1;
+      entry->param_max_len = get_reserved_string_len(params[i].key);
+      if (entry->param_max_len < entry->param_len) {
+        entry->param_max_len = (entry->param_len + 3) / 4 * 4;
+      }
+    } else {
+      entry->param_fmt = 1028;
+      entry->param_len = 4;
+      entry->param_max_len = 4;
+    }
+    key_table.size += strlen(params[i].key) + 1;
+    data_table.size += entry->param_max_len;
+  }
+  key_table.size = (key_table.size + 3) / 4 * 4;
+  if (key_table.size > UINT16_MAX) {
+    fprintf(stderr, "Key table of file \"%s\" is too large.\n",
+      params[0].file_name);
+    return 1;
+  }
+
+  key_table.content = arena_alloc(key_table.size);
+  data_table.content = arena_alloc(data_table.size);
+  if ((key_table.size && key_table.content == NULL) || (data_table.size
+    && data_table.content == NULL)) {
+    fprintf(stderr, "Could not allocate memory for file \"%s\".\n",
+      params[0].file_name);
+    return 1;
+  }
+  memset(key_table.content, 0, key_table.size);
+  memset(data_table.content, 0, data_table.size);
+  for (int i = 0; i < params_count; i++) {
+    strcpy(&key_table.content[entries[i].key_offset], params[i].key);
+    char *data = &data_table.content[entries[i].data_offset];
+    if (entries[i].param_fmt == 516) {
+      strcpy(data, params[i].value);
+    } else {
+      uint32_t integer = strtoul(params[i].value, NULL, 0);
+      memcpy(data, &integer, 4);
+    }
+  }
+  return 0;
+}
+
+// Batch job that builds and saves a single file of option --build-from
+int build_file(char *file_name) {
+  struct spec_file *spec_file = &spec_files[job_index];
+  if (!option_force && !access(file_name, F_OK)) {
+    fprintf(stderr, "File \"%s\" already exists.\n", file_name);
+    return 1;
+  }
+  if (build_param_sfo(spec_file->params, spec_file->params_count)) {
+    return 1;
+  }
+  resize_params();
+  save_to_file(file_name);
+  return 0;
+}
+
+// Builds all files described by a spec file in parallel, then prints a
+// summary; returns the exit code
+int build_files(char *spec_file_name) {
+  int params_count;
+  struct spec_param *params = read_spec(spec_file_name, &params_count);
+
+  char **file_names = NULL;
+  int files_count = 0;
+  for (int i = 0; i < params_count; i++) {
+    if (i == 0 || strcmp(params[i].file_name, params[i - 1].file_name)) {
+      spec_files = _realloc(spec_files,
+        sizeof(struct spec_file) * (files_count + 1));
+      file_names = _realloc(file_names, sizeof(char *) * (files_count + 1));
+      spec_files[files_count].name = params[i].file_name;
+      spec_files[files_count].params = &params[i];
+      spec_files[files_count].params_count = 0;
+      file_names[files_count++] = params[i].file_name;
+    }
+    spec_files[files_count - 1].params_count++;
+  }
+
+  int *exit_codes = _realloc(NULL, sizeof(int) * (files_count + 1));
+  run_jobs(build_file, file_names, files_count, exit_codes);
+  int failed = 0;
+  for (int i = 0; i < files_count; i++) {
+    if (exit_codes[i]) failed++;
+  }
+  printf("%d created, %d failed\n", files_count - failed, failed);
+
+  free(exit_codes);
+  free(file_names);
+  free(spec_files);
+  for (int i = 0; i < params_count; i++) {
+    free(params[i].line);
+  }
+  free(params);
+  return failed ? 1 : 0;
+}
+
+// Returns a PKG entry's file name, as used for extraction
+void get_pkg_entry_name(uint32_t id, char *name, size_t size) {
+  for (int i = 0; i < sizeof(pkg_entry_names) / sizeof(pkg_entry_names[0]);
+    i++) {
+    if (pkg_entry_names[i].id == id) {
+      snprintf(name, size, "%s", pkg_entry_names[i].name);
+      return;
+    }
+  }
+  snprintf(name, size, "entry_0x%04x", id);
+}
+
+// Copies a file's byte range to another file without passing the data through
+// user space
+int copy_range(int in_fd, off_t offset, size_t size, int out_fd) {
+  while (size) {
+    ssize_t copied = -1;
+    errno = ENOSYS;
+#ifdef SYS_copy_file_range
+    // Called via syscall(), as glibc's wrapper requires _GNU_SOURCE, which
+    // would conflict with basename()
+    copied = syscall(SYS_copy_file_range, in_fd, &offset, out_fd, NULL, size,
+      0);
+#endif
+    if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+      || errno == EOPNOTSUPP)) {
+      // File systems that do not support copy_file_range()
+      copied = sendfile(out_fd, in_fd, &offset, size);
+    }
+    if (copied <= 0) {
+      return 1;
+    }
+    if (stats) {
+      __atomic_fetch_add(&stats->bytes_read, copied, __ATOMIC_RELAXED);
+    }
+    size -= copied;
+  }
+  return 0;
+}
+
+// Stores the name of the subdirectory of extract_dir that a PKG file's entries
+// are copied to: the PKG file's name without extension ".pkg"
+void get_extract_dir_name(char *pkg_file_name, char *dir_name, size_t size) {
+  snprintf(dir_name, size, "%s/%s", extract_dir, basename(pkg_file_name));
+  size_t len = strlen(dir_name);
+  if (len > 4 && !strcasecmp(&dir_name[len - 4], ".pkg")) {
+    dir_name[len - 4] = '\0';
+  }
+}
+
+// Copies the requested entries of a PS4 PKG file to a subdirectory of
+// extract_dir, named after the PKG file; returns the exit code
+int extract_pkg_entries(char *pkg_file_name) {
+  int fd = open(pkg_file_name, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open file \"%s\".\n", pkg_file_name);
+    return 1;
+  }
+
+  unsigned char pkg_header[PKG_HEADER_SIZE];
+  if (read_at(fd, pkg_header, sizeof(pkg_header), 0)
+    || memcmp(pkg_header, "\x7f" "CNT", 4)) {
+    fprintf(stderr, "Not a PS4 PKG file: \"%s\".\n", pkg_file_name);
+    close(fd);
+    return 1;
+  }
+  struct stat st;
+  uint32_t pkg_file_count, pkg_table_offset;
+  char *error = "could not get file size";
+  if (fstat(fd, &st) || (error = get_pkg_table(pkg_header, st.st_size,
+    &pkg_file_count, &pkg_table_offset))) {
+    fprintf(stderr, "Invalid PS4 PKG \"%s\": %s.\n", pkg_file_name,
+      error);
+    close(fd);
+    return 1;
+  }
+
+  size_t table_size = sizeof(struct pkg_table_entry) * pkg_file_count;
+  struct pkg_table_entry *table = arena_alloc(table_size);
+  if (table == NULL || read_at(fd, table, table_size, pkg_table_offset)) {
+    fprintf(stderr, "Could not read PKG file table of \"%s\".\n",
+      pkg_file_name);
+    close(fd);
+    return 1;
+  }
+
+  // Create the output subdirectory, named after the PKG file
+  char dir_name[PATH_MAX];
+  get_extract_dir_name(pkg_file_name, dir_name, sizeof(dir_name));
+  if (mkdir(dir_name, 0777) && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory \"%s\".\n", dir_name);
+    close(fd);
+    return 1;
+  }
+
+  int exit_code = 0;
+  for (int i = 0; i < extract_ids_count; i++) {
+    char entry_name[32];
+    get_pkg_entry_name(extract_ids[i], entry_name, sizeof(entry_name));
+
+    int index = find_pkg_entry(table, pkg_file_count, extract_ids[i]);
+    if (index == -1) {
+      fprintf(stderr, "Could not find %s inside \"%s\".\n", entry_name,
+        pkg_file_name);
+      exit_code = 1;
+      continue;
+    }
+    if (pkg_entry_exceeds(&table[index], st.st_size)) {
+      fprintf(stderr, "Invalid PS4 PKG \"%s\": %s exceeds file size.\n",
+        pkg_file_name, entry_name);
+      exit_code = 1;
+      continue;
+    }
+
+    // Write to a temporary file that replaces an existing file only after
+    // all data has been copied, like save_to_file()
+    char out_file_name[PATH_MAX];
+    int out_fd = -1;
+    if (snprintf(out_file_name, sizeof(out_file_name), "%s/%s", dir_name,
+      entry_name) < sizeof(out_file_name) && snprintf(temp_file_name,
+      sizeof(temp_file_name), "%s.XXXXXX", out_file_name)
+      < sizeof(temp_file_name)) {
+      out_fd = mkstemp(temp_file_name);
+    }
+    if (out_fd == -1) {
+      fprintf(stderr, "Could not open file \"%s\" in write mode.\n",
+        out_file_name);
+      temp_file_name[0] = '\0';
+      exit_code = 1;
+      continue;
+    }
+    // mkstemp() creates files with mode 0600
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(out_fd, 0666 & ~mask);
+    if (copy_range(fd, bswap_32(table[index].offset),
+      bswap_32(table[index].size), out_fd)) {
+      fprintf(stderr, "Could not extract %s from \"%s\".\n", entry_name,
+        pkg_file_name);
+      unlink(temp_file_name);
+      exit_code = 1;
+    } else if (rename(temp_file_name, out_file_name)) {
+      fprintf(stderr, "Could not replace file \"%s\".\n", out_file_name);
+      unlink(temp_file_name);
+      exit_code = 1;
+    }
+    temp_file_name[0] = '\0';
+    close(out_fd);
+  }
+
+  close(fd);
+  return exit_code;
+}
+
+// A PKG file's output directory, for finding PKG files that would share one
+struct extract_dir {
+  char *name;
+  char *pkg_file_name;
+};
+
+// Compares two output directories by name, for qsort()
+int compare_extract_dirs(const void *a, const void *b) {
+  return strcmp(((struct extract_dir *) a)->name,
+    ((struct extract_dir *) b)->name);
+}
+
+// Extracts PKG entries from all input files in parallel; returns the exit code
+int extract(void) {
+  // Parallel jobs writing to the same directory would overwrite each other's
+  // files, so the PKG files' names must differ
+  struct extract_dir *dirs = _realloc(NULL,
+    sizeof(struct extract_dir) * input_files_count);
+  for (int i = 0; i < input_files_count; i++) {
+    char dir_name[PATH_MAX];
+    get_extract_dir_name(input_files[i], dir_name, sizeof(dir_name));
+    if ((dirs[i].name = strdup(dir_name)) == NULL) {
+      fprintf(stderr, "Could not allocate memory for path \"%s\".\n",
+        dir_name);
+      exit(1);
+    }
+    dirs[i].pkg_file_name = input_files[i];
+  }
+  if (input_files_count) {
+    qsort(dirs, input_files_count, sizeof(struct extract_dir),
+      compare_extract_dirs);
+  }
+  int collisions = 0;
+  for (int i = 1; i < input_files_count; i++) {
+    if (!compare_extract_dirs(&dirs[i - 1], &dirs[i])) {
+      fprintf(stderr, "Files \"%s\" and \"%s\" would both be extracted to "
+        "\"%s\".\n", dirs[i - 1].pkg_file_name, dirs[i].pkg_file_name,
+        dirs[i].name);
+      collisions++;
+    }
+  }
+  for (int i = 0; i < input_files_count; i++) {
+    free(dirs[i].name);
+  }
+  free(dirs);
+  if (collisions) {
+    exit(1);
+  }
+
+  if (mkdir(extract_dir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory \"%s\".\n", extract_dir);
+    exit(1);
+  }
+  if (extract_ids_count == 0) {
+    extract_ids = _realloc(extract_ids, sizeof(uint32_t));
+    extract_ids[extract_ids_count++] = 0x1000; // param.sfo
+  }
+
+  int *exit_codes = _realloc(NULL, sizeof(int) * input_files_count);
+  run_jobs(extract_pkg_entries, input_files, input_files_count, exit_codes);
+  int exit_code = 0;
+  for (int i = 0; i < input_files_count; i++) {
+    if (exit_codes[i]) {
+      exit_code = 1;
+    }
+  }
+  free(exit_codes);
+  return exit_code;
+}
+
+// Output buffer of the fast path, written to stdout with write() when full
+struct output {
+  char content[4096];
+  size_t len;
+};
+
+// Appends a string to an output buffer; returns 0 on success
+int output_string(struct output *output, char *string, size_t len) {
+  if (output->len + len > sizeof(output->content)) {
+    if (write(STDOUT_FILENO, output->content, output->len) != output->len) {
+      return 1;
+    }
+    output->len = 0;
+    if (len > sizeof(output->content)) {
+      return write(STDOUT_FILENO, string, len) != len;
+    }
+  }
+  memcpy(&output->content[output->len], string, len);
+  output->len += len;
+  return 0;
+}
+
+// Appends a parameter's value and a newline to an output buffer; returns 0 on
+// success
+int output_value(struct output *output, struct index_table_entry *entry) {
+  char *data = &data_table.content[entry->data_offset];
+  if (entry->param_fmt == 1028) {
+    char integer_string[] = "0x00000000\n";
+    uint32_t integer;
+    memcpy(&integer, data, 4);
+    for (int i = 0; i < 8; i++) {
+      integer_string[9 - i] = "0123456789abcdef"[integer >> 4 * i & 0xf];
+    }
+    return output_string(output, integer_string, sizeof(integer_string) - 1);
+  }
+  return output_string(output, data, strlen(data))
+    || output_string(output, "\n", 1);
+}
+
+// Fast path for the most common invocations, "sfo FILE" and
+// "sfo -q PARAMETER FILE": reads the param.sfo with pread() into a stack
+// buffer and writes the output with write(), avoiding stdio, the heap, and
+// locking (saves replace files atomically, so an open file never changes).
+// Returns the exit code, or -1 if the file must take the regular path (which
+// also reports all errors).
+int fast_path(char *file_name, char *key) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  uint32_t magic;
+  if (fstat(fd, &st) || read_at(fd, &magic, 4, 0)) {
+    close(fd);
+    return -1;
+  }
+
+  uint64_t sfo_offset = 0, sfo_size = st.st_size;
+  if (magic == 1414415231) { // PS4 PKG file
+    unsigned char pkg_header[PKG_HEADER_SIZE];
+    uint32_t pkg_file_count, pkg_table_offset;
+    if (read_at(fd, pkg_header, sizeof(pkg_header), 0)
+      || get_pkg_table(pkg_header, st.st_size, &pkg_file_count,
+      &pkg_table_offset)) {
+      close(fd);
+      return -1;
+    }
+    // Search the table in parts that fit into a stack buffer
+    sfo_size = 0;
+    struct pkg_table_entry table[64];
+    for (uint32_t i = 0; i < pkg_file_count; i += 64) {
+      uint32_t count = pkg_file_count - i < 64 ? pkg_file_count - i : 64;
+      if (read_at(fd, table, sizeof(struct pkg_table_entry) * count,
+        pkg_table_offset + (uint64_t) sizeof(struct pkg_table_entry) * i)) {
+        close(fd);
+        return -1;
+      }
+      int index = find_pkg_entry(table, count, 0x1000); // param.sfo
+      if (index != -1) {
+        if (!pkg_entry_exceeds(&table[index], st.st_size)) {
+          sfo_offset = bswap_32(table[index].offset);
+          sfo_size = bswap_32(table[index].size);
+        }
+        break;
+      }
+    }
+  } else if (magic == 1128612691) { // Disc param.sfo
+    sfo_offset = 0x800;
+    sfo_size = sfo_size > 0x800 ? sfo_size - 0x800 : 0;
+  } else if (magic != 1179865088) {
+    sfo_size = 0;
+  }
+
+  // Real param.sfo files are a few KiB in size
+  char sfo[65536] __attribute__((aligned(16)));
+  if (sfo_size < sizeof(struct header) || sfo_size > sizeof(sfo)
+    || read_at(fd, sfo, sfo_size, sfo_offset)) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  // Point the global tables into the buffer and validate them like the
+  // regular path does
+  memcpy(&header, sfo, sizeof(struct header));
+  if (validate_header(sfo_size)) {
+    return -1;
+  }
+  entries = (struct index_table_entry *) &sfo[sizeof(struct header)];
+  key_table.size = header.data_table_offset - header.key_table_offset;
+  key_table.content = &sfo[header.key_table_offset];
+  data_table.size = 0;
+  if (header.entries_count) {
+    uint64_t size = (uint64_t) entries[header.entries_count - 1].data_offset +
+      entries[header.entries_count - 1].param_max_len;
+    if (size > sfo_size - header.data_table_offset) {
+      return -1;
+    }
+    data_table.size = size;
+  }
+  data_table.content = &sfo[header.data_table_offset];
+  if (validate_entries()) {
+    return -1;
+  }
+  char *error = validate_strings();
+  if (error) {
+    fprintf(stderr, "Warning: %s.\n", error);
+  }
+
+  struct output output = {.len = 0};
+  int exit_code = key ? 1 : 0;
+  for (int i = 0; i < header.entries_count; i++) {
+    if (entries[i].param_fmt != 516 && entries[i].param_fmt != 1024
+      && entries[i].param_fmt != 1028) {
+      continue;
+    }
+    char *entry_key = &key_table.content[entries[i].key_offset];
+    if (key == NULL) {
+      if (output_string(&output, entry_key, strlen(entry_key))
+        || output_string(&output, "=", 1) || output_value(&output, &entries[i])) {
+        return 1;
+      }
+    } else if (!strcmp(key, entry_key)) {
+      exit_code = output_value(&output, &entries[i]);
+      break;
+    }
+  }
+  if (output.len && write(STDOUT_FILENO, output.content, output.len)
+    != output.len) {
+    return 1;
+  }
+  return exit_code;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+#ifdef __linux__
+  // "sfo FILE", "sfo -q PARAMETER FILE", and "sfo FILE -q PARAMETER"
+  char *fast_path_file = NULL, *fast_path_key = NULL;
+  if (argc == 2 && argv[1][0] != '-') {
+    fast_path_file = argv[1];
+  } else if (argc == 4 && (!strcmp(argv[1], "-q")
+    || !strcmp(argv[1], "--query")) && argv[3][0] != '-') {
+    fast_path_key = argv[2];
+    fast_path_file = argv[3];
+  } else if (argc == 4 && (!strcmp(argv[2], "-q")
+    || !strcmp(argv[2], "--query")) && argv[1][0] != '-') {
+    fast_path_file = argv[1];
+    fast_path_key = argv[3];
+  }
+  if (fast_path_file) {
+    if (fast_path_key) toupper_string(fast_path_key);
+    int exit_code = fast_path(fast_path_file, fast_path_key);
+    if (exit_code != -1) {
+      return exit_code;
+    }
+  }
+#endif
+
+  atexit(clean_exit);
+
+  char *output_file_name = NULL;
+
+  // Parse command line arguments
+  program_name = argv[0];
+  shift(&argc, &argv);
+  while (argc) {
+    // Parse file names
+    if (argv[0][0] != '-') {
+      input_files = _realloc(input_files,
+        sizeof(char *) * (input_files_count + 1));
+      input_files[input_files_count] = argv[0];
+      input_files_count++;
+    // Parse options
+    } else if (!strcmp(argv[0], "-a") || !strcmp(argv[0], "--add")) {
+      commands = _realloc(commands, sizeof(struct command) * (commands_count + 1));
+      commands[commands_count].cmd = cmd_add;
+      shift(&argc, &argv);
+      // TYPE
+      if (strcmp(argv[0], "str") && strcmp(argv[0], "int")) {
+        fprintf(stderr, "Option --add: TYPE must be \"int\" or \"str\".\n");
+        print_usage(1);
+      }
+      commands[commands_count].param.type = argv[0];
+      shift(&argc, &argv);
+      // NAME
+      toupper_string(argv[0]);
+      commands[commands_count].param.key = argv[0];
+      shift(&argc, &argv);
+      // VALUE
+      commands[commands_count].param.value = argv[0];
+      commands_count++;
+    } else if (!strcmp(argv[0], "--metrics-file")) {
+      shift(&argc, &argv);
+      metrics_file_name = argv[0];
+    } else if (!strcmp(argv[0], "--merge")) {
+      option_merge = 1;
+    } else if (!strcmp(argv[0], "--new-file")) {
+      option_new_file = 1;
+    } else if (!strcmp(argv[0], "--build-from")) {
+      shift(&argc, &argv);
+      spec_file_name = argv[0];
+    } else if (!strcmp(argv[0], "--cache")) {
+      shift(&argc, &argv);
+      cache_file_name = argv[0];
+    } else if (!strcmp(argv[0], "--check")) {
+      option_check = 1;
+    } else if (!strcmp(argv[0], "--compact")) {
+      option_compact = 1;
+    } else if (!strcmp(argv[0], "-d") || !strcmp(argv[0], "--delete")) {
+      commands = _realloc(commands, sizeof(struct command) * (commands_count + 1));
+      commands[commands_count].cmd = cmd_delete;
+      shift(&argc, &argv);
+      // NAME
+      toupper_string(argv[0]);
+      commands[commands_count].param.key = argv[0];
       commands_count++;
     } else if (!strcmp(argv[0], "--debug")) {
       option_debug = 1;
     } else if (!strcmp(argv[0], "--decimal")) {
       option_decimal = 1;
+    } else if (!strcmp(argv[0], "--diff")) {
+      option_diff = 1;
+    } else if (!strcmp(argv[0], "--duplicates")) {
+      option_duplicates = 1;
     } else if (!strcmp(argv[0], "-e") || !strcmp(argv[0], "--edit")) {
       commands = _realloc(commands, sizeof(struct command) * (commands_count + 1));
       commands[commands_count].cmd = cmd_edit;
@@ -864,10 +4657,50 @@ int main(int argc, char *argv[]) {
       // VALUE
       commands[commands_count].param.value = argv[0];
       commands_count++;
+    } else if (!strcmp(argv[0], "--entry")) {
+      shift(&argc, &argv);
+      extract_ids = _realloc(extract_ids,
+        sizeof(uint32_t) * (extract_ids_count + 1));
+      if (parse_pkg_entry_id(argv[0], &extract_ids[extract_ids_count])) {
+        fprintf(stderr, "Option --entry: invalid entry ID \"%s\".\n", argv[0]);
+        print_usage(1);
+      }
+      extract_ids_count++;
+    } else if (!strcmp(argv[0], "--extract")) {
+      shift(&argc, &argv);
+      extract_dir = argv[0];
     } else if (!strcmp(argv[0], "-f") || !strcmp(argv[0], "--force")) {
         option_force = 1;
     } else if (!strcmp(argv[0], "-h") || !strcmp(argv[0], "--help")) {
       print_usage(0);
+    } else if (!strcmp(argv[0], "--io-policy")) {
+      shift(&argc, &argv);
+      if (!strcmp(argv[0], "default")) {
+        io_policy = io_default;
+      } else if (!strcmp(argv[0], "fadvise")) {
+        io_policy = io_fadvise;
+      } else if (!strcmp(argv[0], "direct")) {
+        io_policy = io_direct;
+      } else {
+        fprintf(stderr, "Unknown I/O policy: %s\n", argv[0]);
+        print_usage(1);
+      }
+    } else if (!strcmp(argv[0], "-j") || !strcmp(argv[0], "--jobs")) {
+      shift(&argc, &argv);
+      option_jobs = atoi(argv[0]);
+      if (option_jobs < 1) {
+        fprintf(stderr, "Option --jobs: N must be a positive number.\n");
+        print_usage(1);
+      }
+    } else if (!strcmp(argv[0], "--lock-timeout")) {
+      shift(&argc, &argv);
+      char *end;
+      lock_timeout = strtod(argv[0], &end);
+      if (*argv[0] == '\0' || *end != '\0' || lock_timeout < 0) {
+        fprintf(stderr, "Option --lock-timeout: SECONDS must be a "
+          "non-negative number.\n");
+        print_usage(1);
+      }
     } else if (!strcmp(argv[0], "-o") || !strcmp(argv[0], "--output-file")) {
       shift(&argc, &argv);
       output_file_name = argv[0];
@@ -881,6 +4714,38 @@ int main(int argc, char *argv[]) {
           "  \"%s\"\n, \"%s\"\n.\n", query_string, argv[0]);
         exit(1);
       }
+    } else if (!strcmp(argv[0], "--reserve")) {
+      shift(&argc, &argv);
+      char *end;
+      char *separator = strchr(argv[0], '=');
+      if (separator) { // PARAMETER=LENGTH
+        *separator = '\0';
+        toupper_string(argv[0]);
+        reserves = _realloc(reserves,
+          sizeof(struct reserve) * (reserves_count + 1));
+        reserves[reserves_count].key = argv[0];
+        unsigned long long len = strtoull(separator + 1, &end, 0);
+        if (separator[1] == '\0' || *end != '\0' || separator[1] == '-') {
+          fprintf(stderr, "Option --reserve: invalid length \"%s\".\n",
+            separator + 1);
+          print_usage(1);
+        }
+        if (len > MAX_RESERVE_LEN) {
+          fprintf(stderr, "Option --reserve: length %s exceeds the maximum "
+            "of %d bytes.\n", separator + 1, MAX_RESERVE_LEN);
+          exit(1);
+        }
+        reserves[reserves_count].len = len;
+        reserves_count++;
+      } else { // PERCENT
+        reserve_percent = strtod(argv[0], &end);
+        if (*end == '%') end++;
+        if (*argv[0] == '\0' || *end != '\0' || reserve_percent < 0) {
+          fprintf(stderr, "Option --reserve: invalid percentage \"%s\".\n",
+            argv[0]);
+          print_usage(1);
+        }
+      }
     } else if (!strcmp(argv[0], "-s") || !strcmp(argv[0], "--set")) {
       commands = _realloc(commands, sizeof(struct command) *
         (commands_count + 1));
@@ -900,11 +4765,38 @@ int main(int argc, char *argv[]) {
       // VALUE
       commands[commands_count].param.value = argv[0];
       commands_count++;
+    } else if (!strcmp(argv[0], "--stats")) {
+      option_stats = 1;
+    } else if (!strcmp(argv[0], "--shard")) {
+      shift(&argc, &argv);
+      int n = 0;
+      if (sscanf(argv[0], "%d/%d%n", &shard_index, &shard_count, &n) != 2
+        || argv[0][n] != '\0' || shard_count < 1 || shard_index < 1
+        || shard_index > shard_count) {
+        fprintf(stderr, "Option --shard: K/N must be 2 positive numbers, "
+          "with K not greater than N.\n");
+        print_usage(1);
+      }
+      shard_index--;
+    } else if (!strcmp(argv[0], "--stats-report")) {
+      shift(&argc, &argv);
+      stats_report_format = argv[0];
+      if (strcmp(stats_report_format, "json")
+        && strcmp(stats_report_format, "table")) {
+        fprintf(stderr, "Unknown report format: %s\n", stats_report_format);
+        print_usage(1);
+      }
     } else if (!strcmp(argv[0], "-v") || !strcmp(argv[0], "--verbose")) {
       option_verbose = 1;
+    } else if (!strcmp(argv[0], "--verify")) {
+      option_check = 1;
+      option_verify = 1;
     } else if (!strcmp(argv[0], "--version")) {
       print_version();
       exit(0);
+    } else if (!strcmp(argv[0], "--watch")) {
+      shift(&argc, &argv);
+      watch_dir = argv[0];
     } else {
       fprintf(stderr, "Unknown option: %s\n", argv[0]);
       print_usage(1);
@@ -915,21 +4807,67 @@ int main(int argc, char *argv[]) {
   // DEBUG: Print parsing results
   if (option_debug) {
     fprintf(stderr, "Command line parsing results:\n\n");
-    if (input_file_name == NULL) { // printf + null pointer = undefined behavior
-      fprintf(stderr, "input_file_name: NULL\n");
-    } else {
-      fprintf(stderr, "input_file_name: \"%s\"\n", input_file_name);
+    fprintf(stderr, "input_files_count: %d\n", input_files_count);
+    for (int i = 0; i < input_files_count; i++) {
+      fprintf(stderr, "input_files[%d]: \"%s\"\n", i, input_files[i]);
     }
     if (output_file_name == NULL) {
       fprintf(stderr, "output_file_name: NULL\n");
     } else {
       fprintf(stderr, "output_file_name: \"%s\"\n", output_file_name);
     }
+    if (extract_dir == NULL) {
+      fprintf(stderr, "extract_dir: NULL\n");
+    } else {
+      fprintf(stderr, "extract_dir: \"%s\"\n", extract_dir);
+    }
+    fprintf(stderr, "lock_timeout: %g\n", lock_timeout);
+    fprintf(stderr, "io_policy: %d\n", io_policy);
+    if (metrics_file_name == NULL) {
+      fprintf(stderr, "metrics_file_name: NULL\n");
+    } else {
+      fprintf(stderr, "metrics_file_name: \"%s\"\n", metrics_file_name);
+    }
+    if (spec_file_name == NULL) {
+      fprintf(stderr, "spec_file_name: NULL\n");
+    } else {
+      fprintf(stderr, "spec_file_name: \"%s\"\n", spec_file_name);
+    }
+    if (cache_file_name == NULL) {
+      fprintf(stderr, "cache_file_name: NULL\n");
+    } else {
+      fprintf(stderr, "cache_file_name: \"%s\"\n", cache_file_name);
+    }
+    fprintf(stderr, "option_check: %d\n", option_check);
+    fprintf(stderr, "option_compact: %d\n", option_compact);
     fprintf(stderr, "option_debug: %d\n", option_debug);
     fprintf(stderr, "option_decimal: %d\n", option_decimal);
+    fprintf(stderr, "option_diff: %d\n", option_diff);
+    fprintf(stderr, "option_duplicates: %d\n", option_duplicates);
     fprintf(stderr, "option_force: %d\n", option_force);
+    fprintf(stderr, "option_jobs: %d\n", option_jobs);
+    fprintf(stderr, "option_merge: %d\n", option_merge);
     fprintf(stderr, "option_new_file: %d\n", option_new_file);
+    fprintf(stderr, "option_stats: %d\n", option_stats);
     fprintf(stderr, "option_verbose: %d\n", option_verbose);
+    fprintf(stderr, "option_verify: %d\n", option_verify);
+    fprintf(stderr, "reserve_percent: %g\n", reserve_percent);
+    fprintf(stderr, "shard_index: %d\n", shard_index);
+    fprintf(stderr, "shard_count: %d\n", shard_count);
+    if (stats_report_format == NULL) {
+      fprintf(stderr, "stats_report_format: NULL\n");
+    } else {
+      fprintf(stderr, "stats_report_format: \"%s\"\n", stats_report_format);
+    }
+    for (int i = 0; i < reserves_count; i++) {
+      fprintf(stderr, "reserves[%d]: \"%s\"=%u\n", i, reserves[i].key,
+        reserves[i].len);
+    }
+    if (watch_dir == NULL) {
+      fprintf(stderr, "watch_dir: NULL\n");
+    } else {
+      fprintf(stderr, "watch_dir: \"%s\"\n", watch_dir);
+    }
     if (query_string == NULL) {
       fprintf(stderr, "query_string: NULL\n");
     } else {
@@ -962,114 +4900,221 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "\n");
   }
 
-  // Open file
-  if (!input_file_name) {
-    fprintf(stderr, "Please specify a file name.\n");
-    print_usage(1);
-  }
-  // Optionally create file before opening it
-  if (option_new_file) {
-    if (!option_force && !access(input_file_name, F_OK)) {
-      fprintf(stderr, "File \"%s\" already exists.\n", input_file_name);
-      exit(1);
-    } else {
-      create_param_sfo(input_file_name);
-    }
+#ifdef __linux__
+  if (option_jobs == 0) {
+    option_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (option_jobs < 1) option_jobs = 1;
   }
-  file = fopen(input_file_name, "rb"); // Read only
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", input_file_name);
+#endif
+
+  if (metrics_file_name) {
+#ifdef __linux__
+    init_metrics();
+#else
+    fprintf(stderr, "Option --metrics-file is only supported on Linux.\n");
     exit(1);
+#endif
   }
 
-  // Get SFO header offset
-  uint32_t magic;
-  fread(&magic, 4, 1, file);
-  if (magic == 1414415231) { // PS4 PKG file
-    fseek(file, get_ps4_pkg_offset(), SEEK_SET);
-  } else if (magic == 1128612691) { // Disc param.sfo
-    fseek(file, 0x800, SEEK_SET);
-  } else if (magic == 1179865088) { // Param.sfo file
-    rewind(file);
-  } else {
-    fprintf(stderr, "Param.sfo magic number not found.\n");
+  if (watch_dir) {
+    if (input_files_count || output_file_name || has_modifications()) {
+      fprintf(stderr, "Option --watch cannot be combined with FILE, option "
+        "--output-file, or modification options.\n");
+      print_usage(1);
+    }
+#ifdef __linux__
+    watch(watch_dir);
+#else
+    fprintf(stderr, "Option --watch is only supported on Linux.\n");
     exit(1);
+#endif
   }
 
-  // Load file contents
-  load_header(file);
-  load_entries(file);
-  load_key_table(file);
-  load_data_table(file);
-
-  if (option_debug) {
-    fprintf(stderr, "Memory before running commands:\n\n");
-    print_header();
-    print_entries();
-    print_key_table();
-    print_data_table();
+  if (spec_file_name) {
+    if (input_files_count || output_file_name || commands_count
+      || query_string || option_new_file || extract_dir || option_check
+      || option_duplicates || option_diff || stats_report_format
+      || option_merge || shard_count) {
+      fprintf(stderr, "Option --build-from can only be combined with options "
+        "--compact, --force, --jobs, --metrics-file, --reserve, and "
+        "--stats.\n");
+      print_usage(1);
+    }
+  } else if (!input_files_count) {
+    fprintf(stderr, "Please specify a file name.\n");
+    print_usage(1);
   }
 
-  // If there are any queued commands, run them and save the file
-  if (commands_count) {
-    if (magic == 1414415231) {
-      fprintf(stderr, "Cannot edit PKG files.\n");
+  if (option_stats) {
+#ifdef __linux__
+    stats = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+      fprintf(stderr, "Could not allocate memory for statistics.\n");
       exit(1);
     }
-    if (magic == 1128612691) {
-      fprintf(stderr, "Cannot edit disc param.sfo files.\n");
-      exit(1);
+#else
+    static struct stats local_stats;
+    stats = &local_stats;
+#endif
+  }
+
+  if (option_merge) {
+    if (output_file_name || has_modifications() || query_string
+      || extract_dir || option_check || (shard_count && !option_diff)) {
+      fprintf(stderr, "Option --merge cannot be combined with options "
+        "--check, --extract, --output-file, --query, --shard (except with "
+        "--diff), or modification options.\n");
+      print_usage(1);
+    }
+    if (!cache_file_name && !option_diff && !option_duplicates
+      && !stats_report_format) {
+      fprintf(stderr, "Option --merge requires option --cache, --diff, "
+        "--duplicates, or --stats-report.\n");
+      print_usage(1);
     }
+  }
 
-    for (int i = 0; i < commands_count; i++) {
-      switch (commands[i].cmd) {
-        case cmd_add:
-          add_param(commands[i].param.type, commands[i].param.key,
-            commands[i].param.value, option_force);
-          break;
-        case cmd_delete:
-          delete_param(commands[i].param.key, option_force);
-          break;
-        case cmd_edit:
-          edit_param(commands[i].param.key, commands[i].param.value,
-            option_force);
-          break;
-        case cmd_set:
-          set_param(commands[i].param.type, commands[i].param.key,
-            commands[i].param.value);
-          break;
+  // Keep only this shard's files, by a hash of their names that is the same
+  // on all machines (with option --merge, diff_files() splits the work)
+  if (shard_count && !option_merge) {
+    if (!cache_file_name && (option_diff || option_duplicates
+      || stats_report_format)) {
+      fprintf(stderr, "Option --shard requires option --cache when combined "
+        "with options --diff, --duplicates, or --stats-report.\n");
+      print_usage(1);
+    }
+    int count = 0;
+    for (int i = 0; i < input_files_count; i++) {
+      if (fnv1a(0xcbf29ce484222325, input_files[i], strlen(input_files[i]))
+        % shard_count == shard_index) {
+        input_files[count++] = input_files[i];
       }
     }
+    input_files_count = count;
+  }
 
-    if (option_debug) {
-      fprintf(stderr, "Memory after running commands:\n\n"
-        "Header's table offsets will be updated when saving the file.\n\n");
-      print_header();
-      print_entries();
-      print_key_table();
-      print_data_table();
+  int exit_code;
+  if (spec_file_name) {
+#ifdef __linux__
+    exit_code = build_files(spec_file_name);
+#else
+    fprintf(stderr, "Option --build-from is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (stats_report_format) {
+    if (output_file_name || has_modifications() || query_string
+      || extract_dir || option_check || option_duplicates || option_diff) {
+      fprintf(stderr, "Option --stats-report cannot be combined with options "
+        "--check, --diff, --duplicates, --extract, --output-file, --query, or "
+        "modification options.\n");
+      print_usage(1);
     }
-
-    if (output_file_name) {
-      save_to_file(output_file_name);
-    } else {
-      save_to_file(input_file_name);
+#ifdef __linux__
+    exit_code = print_stats_report();
+#else
+    fprintf(stderr, "Option --stats-report is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (option_diff) {
+    if (output_file_name || has_modifications() || query_string
+      || extract_dir || option_check || option_duplicates) {
+      fprintf(stderr, "Option --diff cannot be combined with options "
+        "--check, --duplicates, --extract, --output-file, --query, or "
+        "modification options.\n");
+      print_usage(1);
     }
-
-    if (query_string) {
-      return print_param(query_string);
+    if (input_files_count < 2 && !option_merge && !shard_count) {
+      fprintf(stderr, "Option --diff requires at least 2 files.\n");
+      print_usage(1);
     }
-  } else {
-    if (output_file_name) {
-      save_to_file(output_file_name);
+#ifdef __linux__
+    exit_code = diff_files();
+#else
+    fprintf(stderr, "Option --diff is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (option_duplicates) {
+    if (output_file_name || has_modifications() || query_string
+      || extract_dir || option_check) {
+      fprintf(stderr, "Option --duplicates cannot be combined with options "
+        "--check, --extract, --output-file, --query, or modification "
+        "options.\n");
+      print_usage(1);
     }
-
-    if (query_string) {
-      return print_param(query_string);
-    } else {
-      print_params();
+#ifdef __linux__
+    exit_code = find_duplicates();
+#else
+    fprintf(stderr, "Option --duplicates is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (option_check) {
+    if (output_file_name || has_modifications() || query_string
+      || extract_dir) {
+      fprintf(stderr, "Option --check cannot be combined with options "
+        "--extract, --output-file, --query, or modification options.\n");
+      print_usage(1);
+    }
+#ifdef __linux__
+    exit_code = check_files();
+#else
+    fprintf(stderr, "Option --check is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (extract_dir) {
+    if (output_file_name || has_modifications() || query_string) {
+      fprintf(stderr, "Option --extract cannot be combined with options "
+        "--output-file, --query, or modification options.\n");
+      print_usage(1);
+    }
+#ifdef __linux__
+    exit_code = extract();
+#else
+    fprintf(stderr, "Option --extract is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if (option_merge) {
+#ifdef __linux__
+    struct record *records = NULL;
+    int records_count = 0;
+    exit_code = merge_segments(&records, &records_count) ? 1 : 0;
+    free_records(records, records_count);
+#else
+    fprintf(stderr, "Option --merge is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else if ((input_files_count > 1 || shard_count) && has_modifications()) {
+    // With option --shard, always report, even if only 1 file is left
+    if (output_file_name || query_string) {
+      fprintf(stderr, "Multiple input files and option --shard cannot be "
+        "combined with options --output-file or --query.\n");
+      print_usage(1);
+    }
+#ifdef __linux__
+    exit_code = modify_files();
+#else
+    fprintf(stderr, "Modifying multiple files is only supported on Linux.\n");
+    exit(1);
+#endif
+  } else {
+    if (input_files_count > 1) {
+      fprintf(stderr, "Only 1 input file is allowed. Conflicting file names:\n"
+        "  \"%s\"\n  \"%s\"\n", input_files[0], input_files[1]);
+      print_usage(1);
     }
+    // With option --shard, the file may belong to another shard
+    exit_code = input_files_count ? process_file(input_files[0],
+      output_file_name) : 0;
   }
 
-  return 0;
+#ifdef __linux__
+  if (metrics) {
+    write_metrics();
+  }
+#endif
+  if (option_stats) {
+    fflush(stdout);
+    print_stats();
+  }
+  return exit_code;
 }